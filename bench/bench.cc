@@ -0,0 +1,656 @@
+/*
+    Copyright (c) 2012, Kenny Chan <kennytm@gmail.com>
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// bench.cc -- Measures the per-call cost of the z14.cc internals, against real
+//             libzmq inproc sockets and the stand-in Mozart interface in this
+//             directory. Run it with 'make run'; an optional argument sets the
+//             number of iterations of each benchmark.
+
+#include "../z14.cc"
+
+using namespace Ozzero;
+
+namespace {
+
+/** Terms allocated by the builtins are thrown away this often. */
+const long HEAP_RESET_INTERVAL = 1024;
+
+long g_iterations = 200000;
+
+/** Call a builtin with its input arguments, and return its first output. */
+OZ_Term call(OZ_CFun builtin, int in_arity, int out_arity,
+             OZ_Term a0 = 0, OZ_Term a1 = 0, OZ_Term a2 = 0, OZ_Term a3 = 0)
+{
+    OZ_Term args[8] = {a0, a1, a2, a3};
+    OZ_Term* locations[8];
+    for (int i = 0; i < in_arity + out_arity; ++ i)
+        locations[i] = &args[i];
+
+    if (builtin(locations) != OZ_ENTAILED)
+    {
+        fprintf(stderr, "a benchmarked builtin failed\n");
+        exit(1);
+    }
+    return out_arity > 0 ? args[in_arity] : 0;
+}
+
+template <typename Op>
+void run(const char* name, Op& op)
+{
+    // Warm up the caches and the lazily created state of libzmq.
+    for (long i = 0; i < g_iterations / 10; ++ i)
+    {
+        op();
+        if (i % HEAP_RESET_INTERVAL == 0)
+            stub_reset_heap();
+    }
+    stub_reset_heap();
+
+    uint64_t start = monotonic_ns();
+    for (long i = 0; i < g_iterations; ++ i)
+    {
+        op();
+        if (i % HEAP_RESET_INTERVAL == 0)
+            stub_reset_heap();
+    }
+    uint64_t elapsed = monotonic_ns() - start;
+    stub_reset_heap();
+
+    printf("%-28s %10.1f ns/op\n", name, static_cast<double>(elapsed) / g_iterations);
+}
+
+//------------------------------------------------------------------------------
+
+struct AtomDecoderLookup
+{
+    const char* names[4];
+    int index;
+    int sink;
+
+    AtomDecoderLookup() : index(0), sink(0)
+    {
+        names[0] = OZ_atomToC(OZ_atom("linger"));
+        names[1] = OZ_atomToC(OZ_atom("sndhwm"));
+        names[2] = OZ_atomToC(OZ_atom("identity"));
+        names[3] = OZ_atomToC(OZ_atom("compressThreshold"));
+    }
+
+    void operator()()
+    {
+        sink += g_atom_decoder.sockopt_map.find(names[index++ & 3])->second;
+    }
+};
+
+OZ_Return parse_poll_events(OZ_Term events_term, short& events)
+{
+    PARSE_FLAGS(g_atom_decoder.poll_events_map, "'pollin' or 'pollout'",
+                0, events_term, events);
+    return OZ_ENTAILED;
+}
+
+struct ParseFlags
+{
+    OZ_Term events_term;
+    short sink;
+
+    ParseFlags() : sink(0)
+    {
+        OZ_Term events[] = {OZ_atom("pollin"), OZ_atom("pollout")};
+        events_term = OZ_toList(2, events);
+    }
+
+    void operator()()
+    {
+        short events;
+        parse_poll_events(events_term, events);
+        sink += events;
+    }
+};
+
+struct SetSockOpt
+{
+    OZ_Term socket;
+    OZ_Term option;
+    OZ_Term value;
+
+    SetSockOpt(OZ_Term socket_, const char* option_, long value_)
+        : socket(socket_), option(OZ_atom(option_)), value(OZ_long(value_)) {}
+
+    void operator()()
+    {
+        call(ozzero_setsockopt, 4, 1, socket, option, OZ_atom("int"), value);
+    }
+};
+
+struct GetSockOpt
+{
+    OZ_Term socket;
+    OZ_Term option;
+    OZ_Term type;
+
+    GetSockOpt(OZ_Term socket_, const char* option_, OZ_Term type_)
+        : socket(socket_), option(OZ_atom(option_)), type(type_) {}
+
+    void operator()()
+    {
+        call(ozzero_getsockopt, 3, 1, socket, option, type);
+    }
+};
+
+struct Poll
+{
+    OZ_Term poll_items;
+
+    Poll(OZ_Term reader, OZ_Term writer)
+    {
+        OZ_Term items[] = {
+            OZ_mkTupleC("#", 3, reader, OZ_atom("pollin"), OZ_unit()),
+            OZ_mkTupleC("#", 3, writer, OZ_atom("pollout"), OZ_unit()),
+        };
+        poll_items = OZ_toList(2, items);
+    }
+
+    void operator()()
+    {
+        call(ozzero_poll, 2, 3, poll_items, OZ_int(0));
+    }
+};
+
+struct MessageLifecycle
+{
+    void operator()()
+    {
+        OZ_Term src = call(ozzero_msg_create, 0, 1);
+        OZ_Term dest = call(ozzero_msg_create, 0, 1);
+        call(ozzero_msg_init_size, 2, 0, src, OZ_int(64));
+        call(ozzero_msg_init, 1, 0, dest);
+        call(ozzero_msg_move, 2, 0, dest, src);
+        call(ozzero_msg_close, 1, 0, src);
+        call(ozzero_msg_close, 1, 0, dest);
+        delete OZ_getExtension(src);
+        delete OZ_getExtension(dest);
+    }
+};
+
+struct ScanFields
+{
+    OZ_Term line;
+    OZ_Term delimiter;
+    OZ_Term offset;
+
+    ScanFields()
+    {
+        static const char text[] = "10001 ~12 47";
+        line = OZ_mkByteString(text, sizeof(text) - 1);
+        delimiter = OZ_int(' ');
+        offset = OZ_int(6);
+    }
+
+    void operator()()
+    {
+        call(ozzero_bytes_split, 2, 1, line, delimiter);
+        call(ozzero_bytes_parse_int, 2, 2, line, offset);
+    }
+};
+
+/** Write a formatted weather update into a frame, as wuserver.oz does. */
+struct MessageFromVS
+{
+    OZ_Term update;
+
+    MessageFromVS()
+    {
+        OZ_Term space = OZ_atom(" ");
+        update = OZ_mkTupleC("#", 5, OZ_int(10001), space, OZ_int(-12), space, OZ_int(47));
+    }
+
+    void operator()()
+    {
+        OZ_Term msg = call(ozzero_msg_create_with_vs, 1, 1, update);
+        call(ozzero_msg_close, 1, 0, msg);
+        delete OZ_getExtension(msg);
+    }
+};
+
+struct SendRecv
+{
+    OZ_Term sender;
+    OZ_Term receiver;
+    OZ_Term payload;
+
+    SendRecv(OZ_Term sender_, OZ_Term receiver_, size_t size)
+        : sender(sender_), receiver(receiver_)
+    {
+        std::string data (size, 'x');
+        payload = OZ_mkByteString(data.data(), data.size());
+    }
+
+    void operator()()
+    {
+        OZ_Term out = call(ozzero_msg_create_with_data, 1, 1, payload);
+        call(ozzero_msg_send, 3, 2, out, sender, OZ_nil());
+        call(ozzero_msg_close, 1, 0, out);
+
+        OZ_Term in = call(ozzero_msg_create, 0, 1);
+        call(ozzero_msg_init, 1, 0, in);
+        call(ozzero_msg_recv, 3, 2, in, receiver, OZ_nil());
+        call(ozzero_msg_data, 1, 1, in);
+        call(ozzero_msg_close, 1, 0, in);
+
+        delete OZ_getExtension(out);
+        delete OZ_getExtension(in);
+    }
+};
+
+/** Pass a small record over inproc by reference. */
+struct TermSendRecv
+{
+    OZ_Term sender;
+    OZ_Term receiver;
+    OZ_Term value;
+
+    TermSendRecv(OZ_Term sender_, OZ_Term receiver_)
+        : sender(sender_), receiver(receiver_)
+    {
+        value = OZ_mkTupleC("point", 2, OZ_int(3), OZ_int(4));
+    }
+
+    void operator()()
+    {
+        call(ozzero_term_send, 3, 2, sender, value, OZ_nil());
+        call(ozzero_term_recv, 2, 3, receiver, OZ_nil());
+    }
+};
+
+/** Queue a burst of two-frame messages with libzmq directly, then drain them
+in a single recvAll. */
+struct RecvAll
+{
+    static const int BURST = 32;
+
+    void* sender_handle;
+    OZ_Term receiver;
+    OZ_Term max_count;
+
+    RecvAll(OZ_Term sender, OZ_Term receiver_)
+        : sender_handle(Socket::coerce(sender)->handle()), receiver(receiver_),
+          max_count(OZ_int(-1)) {}
+
+    void operator()()
+    {
+        for (int i = 0; i < BURST; ++ i)
+        {
+            zmq_send(sender_handle, "topic", 5, ZMQ_SNDMORE);
+            zmq_send(sender_handle, "payload", 7, 0);
+        }
+        OZ_Term messages = call(ozzero_recv_all, 2, 3, receiver, max_count);
+        int count = 0;
+        for (; OZ_isCons(messages); messages = OZ_tail(messages))
+            ++ count;
+        if (count != BURST)
+        {
+            fprintf(stderr, "recvAll returned %d messages instead of %d\n", count, BURST);
+            exit(1);
+        }
+    }
+};
+
+/** Replay a capture of a burst of two-part messages at maximum speed, the way
+a recorded production load would be replayed, and drain it with recvAll. */
+struct ReplayCapture
+{
+    static const int BURST = 64;
+
+    OZ_Term sender;
+    OZ_Term receiver;
+    OZ_Term path;
+    OZ_Term max_count;
+
+    ReplayCapture(OZ_Term sender_, OZ_Term receiver_)
+        : sender(sender_), receiver(receiver_), max_count(OZ_int(-1))
+    {
+        char name[] = "/tmp/ozzero-bench-XXXXXX";
+        close(mkstemp(name));
+        path = OZ_atom(name);
+
+        call(ozzero_capture_start, 2, 0, sender, path);
+        OZ_Term topic = OZ_mkByteString("topic", 5);
+        OZ_Term payload = OZ_mkByteString(std::string(100, 'x').data(), 100);
+        for (int i = 0; i < BURST; ++ i)
+        {
+            call(ozzero_send_to_all, 3, 1, OZ_cons(sender, OZ_nil()), topic, OZ_cons(OZ_atom("sndmore"), OZ_nil()));
+            call(ozzero_send_to_all, 3, 1, OZ_cons(sender, OZ_nil()), payload, OZ_nil());
+        }
+        call(ozzero_capture_stop, 1, 1, sender);
+        call(ozzero_recv_all, 2, 3, receiver, max_count);
+    }
+
+    ~ReplayCapture()
+    {
+        unlink(OZ_atomToC(path));
+    }
+
+    void operator()()
+    {
+        OZ_Term replay = call(ozzero_replay_open, 2, 1, path, OZ_atom("sent"));
+        for (;;)
+        {
+            OZ_Term result = call(ozzero_replay_step, 4, 1, replay, sender, OZ_int(0), OZ_int(-1));
+            const char* name = OZ_isAtom(result) ? OZ_atomToC(result) : "";
+            if (strcmp(name, "done") == 0)
+                break;
+            if (strcmp(name, "blocked") != 0)
+            {
+                fprintf(stderr, "replay stopped before the end of the capture\n");
+                exit(1);
+            }
+            // Inproc credit comes back asynchronously; wait for it as the Oz
+            // side would.
+            zmq_pollitem_t item = {Socket::coerce(sender)->handle(), 0, ZMQ_POLLOUT, 0};
+            zmq_poll(&item, 1, -1);
+        }
+        call(ozzero_replay_close, 1, 1, replay);
+        delete OZ_getExtension(replay);
+
+        OZ_Term messages = call(ozzero_recv_all, 2, 3, receiver, max_count);
+        int count = 0;
+        for (; OZ_isCons(messages); messages = OZ_tail(messages))
+            ++ count;
+        if (count != BURST)
+        {
+            fprintf(stderr, "replayed %d messages instead of %d\n", count, BURST);
+            exit(1);
+        }
+    }
+};
+
+/** Echoes every frame back as soon as it arrives, spinning so that its own
+wakeup does not hide the latency of the side being measured. An empty frame
+stops it. */
+void* echo_main(void* socket)
+{
+    for (;;)
+    {
+        zmq_msg_t msg;
+        zmq_msg_init(&msg);
+        if (zmq_msg_recv(&msg, socket, ZMQ_DONTWAIT) < 0)
+        {
+            zmq_msg_close(&msg);
+            continue;
+        }
+        bool stop = zmq_msg_size(&msg) == 0;
+        zmq_msg_send(&msg, socket, 0);
+        zmq_msg_close(&msg);
+        if (stop)
+            return NULL;
+    }
+}
+
+/** A ping to the echo thread, waiting for the reply like the Oz side does: the
+busyPoll builtin, then a blocking zmq_poll (standing for OS.readSelect) when it
+says to park. */
+struct RoundTrip
+{
+    OZ_Term client;
+    void* client_handle;
+    OZ_Term payload;
+    OZ_Term dontwait;
+    OZ_Term pollin;
+    OZ_Term park;
+
+    RoundTrip(OZ_Term client_)
+        : client(client_), client_handle(Socket::coerce(client_)->handle()),
+          payload(OZ_mkByteString("ping", 4)), dontwait(OZ_atom("dontwait")),
+          pollin(OZ_atom("pollin")), park(OZ_atom("park")) {}
+
+    void operator()()
+    {
+        OZ_Term out = call(ozzero_msg_create_with_data, 1, 1, payload);
+        call(ozzero_msg_send, 3, 2, out, client, OZ_nil());
+        call(ozzero_msg_close, 1, 0, out);
+
+        OZ_Term in = call(ozzero_msg_create, 0, 1);
+        call(ozzero_msg_init, 1, 0, in);
+        for (;;)
+        {
+            OZ_Term completed = call(ozzero_msg_recv, 3, 2, in, client, dontwait);
+            if (OZ_isTrue(completed))
+                break;
+            if (call(ozzero_busy_poll, 2, 1, client, pollin) == park)
+            {
+                zmq_pollitem_t item = {client_handle, 0, ZMQ_POLLIN, 0};
+                zmq_poll(&item, 1, -1);
+            }
+        }
+        call(ozzero_msg_close, 1, 0, in);
+
+        delete OZ_getExtension(out);
+        delete OZ_getExtension(in);
+    }
+};
+
+/** A ping to the echo thread, waiting for the reply in the epoll backed
+poller. The send puts the client into the recheck list, and the reply mostly
+lands while the poller is already blocked on the descriptor, which a poller
+skipping sockets it checked earlier in the same wait would never report. */
+struct PollerRoundTrip
+{
+    Socket* client;
+    OZ_Term poller;
+
+    PollerRoundTrip(OZ_Term client_)
+        : client(Socket::coerce(client_)), poller(call(ozzero_poller_new, 0, 1))
+    {
+        call(ozzero_poller_add, 3, 1, poller, client_, OZ_atom("pollin"));
+    }
+
+    ~PollerRoundTrip()
+    {
+        call(ozzero_poller_close, 1, 0, poller);
+    }
+
+    void operator()()
+    {
+        zmq_msg_t msg;
+        zmq_msg_init_size(&msg, 4);
+        memcpy(zmq_msg_data(&msg), "ping", 4);
+        client->send_raw(&msg, 0);
+        zmq_msg_close(&msg);
+
+        call(ozzero_poller_wait, 2, 2, poller, OZ_int(-1));
+
+        zmq_msg_init(&msg);
+        client->recv_raw(&msg, ZMQ_DONTWAIT);
+        zmq_msg_close(&msg);
+    }
+};
+
+OZ_Term make_socket(OZ_Term context, const char* type)
+{
+    return call(ozzero_socket, 3, 1, context, OZ_atom(type), OZ_atom("none"));
+}
+
+/** Many idle PAIR sockets, each fed by a plain libzmq socket. */
+struct ManySockets
+{
+    static const int COUNT = 256;
+
+    std::vector<void*> senders;
+    std::vector<OZ_Term> receivers;
+
+    explicit ManySockets(OZ_Term context)
+    {
+        void* context_handle = Context::coerce(context)->state().handle;
+        for (int i = 0; i < COUNT; ++ i)
+        {
+            char address[64];
+            sprintf(address, "inproc://bench-many-%d", i);
+            OZ_Term receiver = make_socket(context, "pair");
+            call(ozzero_bind, 2, 0, receiver, OZ_atom(address));
+            void* sender = zmq_socket(context_handle, ZMQ_PAIR);
+            zmq_connect(sender, address);
+            receivers.push_back(receiver);
+            senders.push_back(sender);
+        }
+    }
+
+    void close()
+    {
+        for (int i = 0; i < COUNT; ++ i)
+        {
+            zmq_close(senders[i]);
+            call(ozzero_close, 1, 0, receivers[i]);
+        }
+    }
+};
+
+/** Wake up for one message among many idle sockets, either with a zmq_poll
+over all of them or with the epoll backed poller. */
+struct PollMany
+{
+    ManySockets& sockets;
+    bool use_poller;
+    OZ_Term poll_items;
+    OZ_Term poller;
+    int next;
+
+    PollMany(ManySockets& sockets_, bool use_poller_)
+        : sockets(sockets_), use_poller(use_poller_), next(0)
+    {
+        OZ_Term pollin = OZ_atom("pollin");
+        std::vector<OZ_Term> items;
+        for (int i = 0; i < ManySockets::COUNT; ++ i)
+            items.push_back(OZ_mkTupleC("#", 3, sockets.receivers[i], pollin, OZ_unit()));
+        poll_items = OZ_toList(items.size(), items.data());
+
+        poller = call(ozzero_poller_new, 0, 1);
+        for (int i = 0; i < ManySockets::COUNT; ++ i)
+            call(ozzero_poller_add, 3, 1, poller, sockets.receivers[i], pollin);
+    }
+
+    ~PollMany()
+    {
+        call(ozzero_poller_close, 1, 0, poller);
+    }
+
+    void operator()()
+    {
+        zmq_send(sockets.senders[next], "x", 1, 0);
+        if (use_poller)
+            call(ozzero_poller_wait, 2, 2, poller, OZ_int(-1));
+        else
+            call(ozzero_poll, 2, 3, poll_items, OZ_int(-1));
+
+        zmq_msg_t msg;
+        zmq_msg_init(&msg);
+        Socket::coerce(sockets.receivers[next])->recv_raw(&msg, 0);
+        zmq_msg_close(&msg);
+        next = (next + 1) % ManySockets::COUNT;
+    }
+};
+
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1)
+        g_iterations = std::max(atol(argv[1]), 10L);
+    oz_init_module();
+
+    OZ_Term context = call(ozzero_ctx_new, 1, 1, OZ_int(1));
+    OZ_Term sender = make_socket(context, "pair");
+    OZ_Term receiver = make_socket(context, "pair");
+    call(ozzero_bind, 2, 0, receiver, OZ_atom("inproc://bench"));
+    call(ozzero_connect, 2, 0, sender, OZ_atom("inproc://bench"));
+
+    OZ_Term client = make_socket(context, "pair");
+    void* echo = zmq_socket(Context::coerce(context)->state().handle, ZMQ_PAIR);
+    zmq_bind(echo, "inproc://bench-echo");
+    call(ozzero_connect, 2, 0, client, OZ_atom("inproc://bench-echo"));
+    pthread_t echo_thread;
+    pthread_create(&echo_thread, NULL, echo_main, echo);
+
+    // The benchmarks keep their input terms from here on.
+    AtomDecoderLookup atom_decoder_lookup;
+    ParseFlags parse_flags;
+    SetSockOpt set_linger (sender, "linger", 0);
+    SetSockOpt set_private (sender, "compressThreshold", -1);
+    GetSockOpt get_int (sender, "sndhwm", OZ_atom("int"));
+    GetSockOpt get_bytes (sender, "identity", OZ_int(255));
+    Poll poll (receiver, sender);
+    MessageLifecycle message_lifecycle;
+    ScanFields scan_fields;
+    MessageFromVS message_from_vs;
+    SendRecv send_recv_small (sender, receiver, 16);
+    SendRecv send_recv_large (sender, receiver, 4096);
+    TermSendRecv term_send_recv (sender, receiver);
+    RecvAll recv_all (sender, receiver);
+    ReplayCapture replay_capture (sender, receiver);
+    RoundTrip round_trip (client);
+    PollerRoundTrip poller_round_trip (client);
+    SetSockOpt park_at_once (client, "busyPoll", 0);
+    SetSockOpt spin_first (client, "busyPoll", 100);
+    ManySockets many_sockets (context);
+    PollMany zmq_poll_many (many_sockets, false);
+    PollMany poller_many (many_sockets, true);
+    stub_mark_heap();
+
+    run("AtomDecoder lookup", atom_decoder_lookup);
+    run("PARSE_FLAGS [pollin pollout]", parse_flags);
+    run("setsockopt int", set_linger);
+    run("setsockopt private option", set_private);
+    run("getsockopt int", get_int);
+    run("getsockopt bytes", get_bytes);
+    run("poll marshalling, 2 items", poll);
+    run("msg create/move/close", message_lifecycle);
+    run("bytesSplit + bytesParseInt", scan_fields);
+    run("msgCreateWithVS, 5 pieces", message_from_vs);
+    run("send+recv 16 bytes", send_recv_small);
+    run("send+recv 4096 bytes", send_recv_large);
+    run("termSend+termRecv", term_send_recv);
+    run("32 sends + recvAll", recv_all);
+    run("replay 64 messages + recvAll", replay_capture);
+    run("wake 1 of 256, zmq_poll", zmq_poll_many);
+    run("wake 1 of 256, poller", poller_many);
+
+    park_at_once();
+    run("round trip, busyPoll 0", round_trip);
+    spin_first();
+    run("round trip, busyPoll 100", round_trip);
+    run("round trip, poller", poller_round_trip);
+
+    many_sockets.close();
+
+    zmq_send(Socket::coerce(client)->handle(), "", 0, 0);
+    pthread_join(echo_thread, NULL);
+    zmq_close(echo);
+    call(ozzero_close, 1, 0, client);
+
+    call(ozzero_close, 1, 0, sender);
+    call(ozzero_close, 1, 0, receiver);
+    call(ozzero_ctx_destroy, 1, 1, context);
+    return 0;
+}
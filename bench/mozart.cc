@@ -0,0 +1,511 @@
+/*
+    Copyright (c) 2012, Kenny Chan <kennytm@gmail.com>
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// mozart.cc -- Implementation of the stand-in Mozart C interface. See mozart.h.
+
+#include "mozart.h"
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <map>
+#include "../m14/am.hh"
+#include "../m14/bytedata.hh"
+
+AM am;
+
+namespace {
+
+struct Term
+{
+    enum Kind { ATOM, NAME, INT, FLOAT, TUPLE, RECORD, EXTENSION, VARIABLE };
+
+    Kind kind;
+    /** The print name of atoms and names, and the label of tuples and records. */
+    const char* name;
+    long value;
+    double float_value;
+    int width;
+    OZ_Term* args;
+    /** The features of a record, as atoms. */
+    OZ_Term* features;
+    OZ_Extension* extension;
+    /** What a variable is bound to, or 0. */
+    OZ_Term ref;
+};
+
+/** A bump allocator for terms, which can be rolled back to a mark. */
+class Heap
+{
+    static const size_t BLOCK_SIZE = 1 << 20;
+
+    std::vector<char*> _blocks;
+    size_t _used;
+    size_t _mark_blocks;
+    size_t _mark_used;
+
+public:
+    Heap() : _used(BLOCK_SIZE), _mark_blocks(0), _mark_used(BLOCK_SIZE) {}
+
+    void* allocate(size_t size)
+    {
+        size = (size + 15) & ~static_cast<size_t>(15);
+        if (_used + size > BLOCK_SIZE)
+        {
+            _blocks.push_back(static_cast<char*>(malloc(size > BLOCK_SIZE ? size : BLOCK_SIZE)));
+            _used = 0;
+        }
+        void* result = _blocks.back() + _used;
+        _used += size;
+        return result;
+    }
+
+    void mark()
+    {
+        _mark_blocks = _blocks.size();
+        _mark_used = _used;
+    }
+
+    void reset()
+    {
+        for (size_t i = _mark_blocks; i < _blocks.size(); ++ i)
+            free(_blocks[i]);
+        _blocks.resize(_mark_blocks);
+        _used = _mark_used;
+    }
+};
+
+Heap g_heap;
+
+class StubByteString : public ByteString
+{
+public:
+    StubByteString(const char* bytes, size_t size)
+    {
+        data = static_cast<BYTE*>(malloc(size + 1));
+        memcpy(data, bytes, size);
+        width = static_cast<int>(size);
+    }
+
+    ~StubByteString() { free(data); }
+
+    virtual int getIdV() { return OZ_E_BYTESTRING; }
+    virtual OZ_Extension* gCollectV() { return this; }
+    virtual OZ_Extension* sCloneV() { return this; }
+    virtual void gCollectRecurseV() {}
+    virtual void sCloneRecurseV() {}
+};
+
+std::vector<StubByteString*> g_byte_strings;
+size_t g_byte_strings_mark = 0;
+
+std::map<std::string, Term*> g_atoms;
+
+Term* make_term(Term::Kind kind)
+{
+    Term* term = static_cast<Term*>(g_heap.allocate(sizeof(Term)));
+    memset(term, 0, sizeof(Term));
+    term->kind = kind;
+    return term;
+}
+
+Term* make_constant(Term::Kind kind, const char* name)
+{
+    Term* term = new Term;
+    memset(term, 0, sizeof(Term));
+    term->kind = kind;
+    term->name = strdup(name);
+    return term;
+}
+
+inline Term* T(OZ_Term term)
+{
+    return reinterpret_cast<Term*>(OZ_deref(term));
+}
+
+inline OZ_Term Z(Term* term)
+{
+    return reinterpret_cast<OZ_Term>(term);
+}
+
+Term* make_tuple(const char* label, int width)
+{
+    Term* term = make_term(Term::TUPLE);
+    term->name = label;
+    term->width = width;
+    term->args = static_cast<OZ_Term*>(g_heap.allocate(sizeof(OZ_Term) * (width + 1)));
+    return term;
+}
+
+Term* g_true = make_constant(Term::NAME, "true");
+Term* g_false = make_constant(Term::NAME, "false");
+Term* g_unit = make_constant(Term::NAME, "unit");
+
+void append_virtual_string(OZ_Term term, std::string& result)
+{
+    Term* t = T(term);
+    char buffer[32];
+    switch (t->kind)
+    {
+        case Term::ATOM:
+            if (strcmp(t->name, "nil") != 0 && strcmp(t->name, "#") != 0)
+                result += t->name;
+            break;
+        case Term::INT:
+            snprintf(buffer, sizeof(buffer), "%ld", t->value);
+            if (buffer[0] == '-')
+                buffer[0] = '~';
+            result += buffer;
+            break;
+        case Term::FLOAT:
+            snprintf(buffer, sizeof(buffer), "%g", t->float_value);
+            result += buffer;
+            break;
+        case Term::EXTENSION:
+        {
+            ByteString* bs = static_cast<ByteString*>(t->extension);
+            result.append(reinterpret_cast<const char*>(bs->getData()), bs->getSize());
+            break;
+        }
+        case Term::TUPLE:
+            if (strcmp(t->name, "|") == 0)
+            {
+                for (; OZ_isCons(term); term = OZ_tail(term))
+                    result += static_cast<char>(OZ_intToC(OZ_head(term)));
+            }
+            else
+            {
+                for (int i = 0; i < t->width; ++ i)
+                    append_virtual_string(t->args[i], result);
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+}
+
+void stub_mark_heap()
+{
+    g_heap.mark();
+    g_byte_strings_mark = g_byte_strings.size();
+}
+
+void stub_reset_heap()
+{
+    g_heap.reset();
+    for (size_t i = g_byte_strings_mark; i < g_byte_strings.size(); ++ i)
+        delete g_byte_strings[i];
+    g_byte_strings.resize(g_byte_strings_mark);
+}
+
+OZ_Term OZ_deref(OZ_Term term)
+{
+    Term* t = reinterpret_cast<Term*>(term);
+    while (t->kind == Term::VARIABLE && t->ref != 0)
+        t = reinterpret_cast<Term*>(t->ref);
+    return Z(t);
+}
+
+int OZ_isAtom(OZ_Term term) { return T(term)->kind == Term::ATOM; }
+int OZ_isInt(OZ_Term term) { return T(term)->kind == Term::INT; }
+int OZ_isSmallInt(OZ_Term term) { return OZ_isInt(term); }
+int OZ_isFloat(OZ_Term term) { return T(term)->kind == Term::FLOAT; }
+int OZ_isNil(OZ_Term term) { return T(term) == T(OZ_nil()); }
+int OZ_isTrue(OZ_Term term) { return T(term) == g_true; }
+int OZ_isUnit(OZ_Term term) { return T(term) == g_unit; }
+int OZ_isVariable(OZ_Term term) { return T(term)->kind == Term::VARIABLE; }
+int OZ_isExtension(OZ_Term term) { return T(term)->kind == Term::EXTENSION; }
+
+int OZ_isCons(OZ_Term term)
+{
+    Term* t = T(term);
+    return t->kind == Term::TUPLE && t->width == 2 && strcmp(t->name, "|") == 0;
+}
+
+int OZ_isTuple(OZ_Term term)
+{
+    Term* t = T(term);
+    return t->kind == Term::TUPLE || t->kind == Term::ATOM;
+}
+
+int OZ_isByteString(OZ_Term term)
+{
+    Term* t = T(term);
+    return t->kind == Term::EXTENSION && t->extension->getIdV() == OZ_E_BYTESTRING;
+}
+
+int OZ_isVirtualString(OZ_Term term, OZ_Term* var)
+{
+    Term* t = T(term);
+    switch (t->kind)
+    {
+        case Term::ATOM:
+        case Term::INT:
+        case Term::FLOAT:
+            return 1;
+        case Term::EXTENSION:
+            return OZ_isByteString(term);
+        case Term::TUPLE:
+            if (OZ_isCons(term))
+            {
+                for (; OZ_isCons(term); term = OZ_tail(term))
+                    if (!OZ_isInt(OZ_head(term)))
+                        return 0;
+                return OZ_isNil(term);
+            }
+            if (strcmp(t->name, "#") != 0)
+                return 0;
+            for (int i = 0; i < t->width; ++ i)
+                if (!OZ_isVirtualString(t->args[i], var))
+                    return 0;
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+OZ_Term OZ_atom(const char* name)
+{
+    std::map<std::string, Term*>::iterator it = g_atoms.find(name);
+    if (it != g_atoms.end())
+        return Z(it->second);
+    Term* term = make_constant(Term::ATOM, name);
+    g_atoms.insert(std::make_pair(std::string(name), term));
+    return Z(term);
+}
+
+const char* OZ_atomToC(OZ_Term term) { return T(term)->name; }
+
+OZ_Term OZ_long(long value)
+{
+    Term* term = make_term(Term::INT);
+    term->value = value;
+    return Z(term);
+}
+
+OZ_Term OZ_int(int value) { return OZ_long(value); }
+OZ_Term OZ_unsignedLong(unsigned long value) { return OZ_long(static_cast<long>(value)); }
+
+OZ_Term OZ_CStringToInt(const char* string)
+{
+    std::string copy (string);
+    if (!copy.empty() && copy[0] == '~')
+        copy[0] = '-';
+    return OZ_long(strtol(copy.c_str(), NULL, 10));
+}
+
+int OZ_intToC(OZ_Term term) { return static_cast<int>(T(term)->value); }
+long OZ_intToCL(OZ_Term term) { return T(term)->value; }
+unsigned long OZ_intToCulong(OZ_Term term) { return static_cast<unsigned long>(T(term)->value); }
+
+OZ_Term OZ_float(double value)
+{
+    Term* term = make_term(Term::FLOAT);
+    term->float_value = value;
+    return Z(term);
+}
+
+double OZ_floatToC(OZ_Term term) { return T(term)->float_value; }
+
+char* OZ_toC(OZ_Term term, int, int)
+{
+    static std::string buffer;
+    buffer.clear();
+    append_virtual_string(term, buffer);
+    return const_cast<char*>(buffer.c_str());
+}
+
+char* OZ_virtualStringToC(OZ_Term term, int* length)
+{
+    static std::string buffer;
+    buffer.clear();
+    append_virtual_string(term, buffer);
+    if (length != NULL)
+        *length = static_cast<int>(buffer.size());
+    return const_cast<char*>(buffer.c_str());
+}
+
+OZ_Term OZ_true() { return Z(g_true); }
+OZ_Term OZ_false() { return Z(g_false); }
+OZ_Term OZ_unit() { return Z(g_unit); }
+OZ_Term OZ_nil() { static OZ_Term nil = OZ_atom("nil"); return nil; }
+
+OZ_Term OZ_cons(OZ_Term head, OZ_Term tail)
+{
+    Term* term = make_tuple("|", 2);
+    term->args[0] = head;
+    term->args[1] = tail;
+    return Z(term);
+}
+
+OZ_Term OZ_head(OZ_Term term) { return T(term)->args[0]; }
+OZ_Term OZ_tail(OZ_Term term) { return T(term)->args[1]; }
+
+OZ_Term OZ_toList(int count, OZ_Term* terms)
+{
+    OZ_Term list = OZ_nil();
+    while (count > 0)
+        list = OZ_cons(terms[--count], list);
+    return list;
+}
+
+OZ_Term OZ_string(const char* string)
+{
+    std::vector<OZ_Term> chars;
+    for (; *string; ++ string)
+        chars.push_back(OZ_int(static_cast<unsigned char>(*string)));
+    return OZ_toList(static_cast<int>(chars.size()), chars.data());
+}
+
+OZ_Term OZ_mkTupleC(const char* label, int width, ...)
+{
+    Term* term = make_tuple(label, width);
+    va_list args;
+    va_start(args, width);
+    for (int i = 0; i < width; ++ i)
+        term->args[i] = va_arg(args, OZ_Term);
+    va_end(args);
+    return Z(term);
+}
+
+OZ_Term OZ_recordInitC(const char* label, OZ_Term props)
+{
+    int width = 0;
+    for (OZ_Term it = props; OZ_isCons(it); it = OZ_tail(it))
+        ++ width;
+
+    Term* term = make_tuple(label, width);
+    term->kind = Term::RECORD;
+    term->features = static_cast<OZ_Term*>(g_heap.allocate(sizeof(OZ_Term) * (width + 1)));
+    for (int i = 0; i < width; ++ i, props = OZ_tail(props))
+    {
+        Term* pair = T(OZ_head(props));
+        term->features[i] = pair->args[0];
+        term->args[i] = pair->args[1];
+    }
+    return Z(term);
+}
+
+OZ_Term OZ_pair2(OZ_Term left, OZ_Term right) { return OZ_mkTupleC("#", 2, left, right); }
+OZ_Term OZ_pairA(const char* feature, OZ_Term value) { return OZ_pair2(OZ_atom(feature), value); }
+OZ_Term OZ_pairAI(const char* feature, int value) { return OZ_pairA(feature, OZ_int(value)); }
+
+OZ_Term OZ_label(OZ_Term term)
+{
+    Term* t = T(term);
+    return t->kind == Term::ATOM ? Z(t) : OZ_atom(t->name);
+}
+
+int OZ_width(OZ_Term term) { return T(term)->width; }
+OZ_Term OZ_getArg(OZ_Term term, int index) { return T(term)->args[index]; }
+
+OZ_Term OZ_extension(OZ_Extension* extension)
+{
+    Term* term = make_term(Term::EXTENSION);
+    term->extension = extension;
+    return Z(term);
+}
+
+OZ_Extension* OZ_getExtension(OZ_Term term) { return T(term)->extension; }
+
+OZ_Term OZ_mkByteString(const char* data, size_t size)
+{
+    StubByteString* bs = new StubByteString(data, size);
+    g_byte_strings.push_back(bs);
+    return OZ_extension(bs);
+}
+
+OZ_Term OZ_newVariable() { return Z(make_term(Term::VARIABLE)); }
+int OZ_protect(OZ_Term*) { return 1; }
+int OZ_unprotect(OZ_Term*) { return 1; }
+
+OZ_Return OZ_unify(OZ_Term left, OZ_Term right)
+{
+    Term* l = T(left);
+    Term* r = T(right);
+    if (l == r)
+        return OZ_ENTAILED;
+    if (l->kind == Term::VARIABLE)
+        l->ref = Z(r);
+    else if (r->kind == Term::VARIABLE)
+        r->ref = Z(l);
+    else
+        return OZ_FAILED;
+    return OZ_ENTAILED;
+}
+
+OZ_Return OZ_suspendOnInternal(OZ_Term)
+{
+    fprintf(stderr, "builtin suspended on an unbound variable\n");
+    return OZ_SUSPEND;
+}
+
+OZ_Return OZ_raiseErrorC(const char* label, int arity, ...)
+{
+    fprintf(stderr, "raised %s", label);
+    va_list args;
+    va_start(args, arity);
+    for (int i = 0; i < arity; ++ i)
+    {
+        OZ_Term arg = va_arg(args, OZ_Term);
+        fprintf(stderr, " %s", OZ_isAtom(arg) ? OZ_atomToC(arg) : OZ_toC(arg, 0, 0));
+    }
+    va_end(args);
+    fprintf(stderr, "\n");
+    return OZ_RAISE;
+}
+
+OZ_Return OZ_typeError(int position, const char* expected)
+{
+    fprintf(stderr, "type error at argument %d: expected %s\n", position, expected);
+    return OZ_RAISE;
+}
+
+void OZ_error(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    vfprintf(stderr, format, args);
+    va_end(args);
+    fprintf(stderr, "\n");
+}
+
+int oz_newUniqueId()
+{
+    static int next_id = OZ_E_BYTESTRING + 1;
+    return next_id++;
+}
+
+// The parts of the Mozart byte data classes that the stub byte strings use.
+int BytePtr::getSize() { return 0; }
+void BytePtr::sCloneRecurseV() {}
+void BytePtr::gCollectRecurseV() {}
+int ByteData::getSize() { return width; }
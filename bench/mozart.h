@@ -0,0 +1,187 @@
+/*
+    Copyright (c) 2012, Kenny Chan <kennytm@gmail.com>
+    All rights reserved.
+
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are met:
+
+    1. Redistributions of source code must retain the above copyright notice,
+       this list of conditions and the following disclaimer.
+    2. Redistributions in binary form must reproduce the above copyright notice,
+       this list of conditions and the following disclaimer in the documentation
+       and/or other materials provided with the distribution.
+
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+    AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+    IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+    ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+    LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+    CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+    SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+    INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+    CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+    ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+    POSSIBILITY OF SUCH DAMAGE.
+*/
+
+// mozart.h -- A stand-in for the part of the Mozart C interface used by z14.cc,
+//             so that its internals can be benchmarked without an emulator.
+//             Terms live in a bump allocator which the caller rolls back
+//             between batches. Nothing here is garbage collected.
+
+#ifndef BENCH_MOZART_H
+#define BENCH_MOZART_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uintptr_t OZ_Term;
+typedef int OZ_Return;
+
+#define OZ_FAILED 0
+#define OZ_ENTAILED 1
+#define OZ_SUSPEND 2
+#define OZ_RAISE 3
+
+#define OZ_E_BYTESTRING 1
+
+#define Assert(Cond)
+
+class OZ_Extension
+{
+public:
+    virtual ~OZ_Extension() {}
+    virtual int getIdV() = 0;
+    virtual OZ_Term printV(int depth = 10) { return 0; }
+    virtual OZ_Extension* gCollectV() = 0;
+    virtual OZ_Extension* sCloneV() = 0;
+    virtual void gCollectRecurseV() = 0;
+    virtual void sCloneRecurseV() = 0;
+};
+
+OZ_Term OZ_deref(OZ_Term term);
+
+int OZ_isAtom(OZ_Term term);
+int OZ_isInt(OZ_Term term);
+int OZ_isSmallInt(OZ_Term term);
+int OZ_isFloat(OZ_Term term);
+int OZ_isCons(OZ_Term term);
+int OZ_isNil(OZ_Term term);
+int OZ_isTuple(OZ_Term term);
+int OZ_isTrue(OZ_Term term);
+int OZ_isUnit(OZ_Term term);
+int OZ_isVariable(OZ_Term term);
+int OZ_isExtension(OZ_Term term);
+int OZ_isByteString(OZ_Term term);
+int OZ_isVirtualString(OZ_Term term, OZ_Term* var);
+
+OZ_Term OZ_atom(const char* name);
+const char* OZ_atomToC(OZ_Term term);
+OZ_Term OZ_int(int value);
+OZ_Term OZ_long(long value);
+OZ_Term OZ_unsignedLong(unsigned long value);
+OZ_Term OZ_CStringToInt(const char* string);
+int OZ_intToC(OZ_Term term);
+long OZ_intToCL(OZ_Term term);
+unsigned long OZ_intToCulong(OZ_Term term);
+OZ_Term OZ_float(double value);
+double OZ_floatToC(OZ_Term term);
+char* OZ_toC(OZ_Term term, int depth, int width);
+char* OZ_virtualStringToC(OZ_Term term, int* length);
+
+OZ_Term OZ_true();
+OZ_Term OZ_false();
+OZ_Term OZ_unit();
+OZ_Term OZ_nil();
+OZ_Term OZ_cons(OZ_Term head, OZ_Term tail);
+OZ_Term OZ_head(OZ_Term term);
+OZ_Term OZ_tail(OZ_Term term);
+OZ_Term OZ_toList(int count, OZ_Term* terms);
+OZ_Term OZ_string(const char* string);
+
+OZ_Term OZ_mkTupleC(const char* label, int width, ...);
+OZ_Term OZ_recordInitC(const char* label, OZ_Term props);
+OZ_Term OZ_pair2(OZ_Term left, OZ_Term right);
+OZ_Term OZ_pairA(const char* feature, OZ_Term value);
+OZ_Term OZ_pairAI(const char* feature, int value);
+OZ_Term OZ_label(OZ_Term term);
+int OZ_width(OZ_Term term);
+OZ_Term OZ_getArg(OZ_Term term, int index);
+
+OZ_Term OZ_extension(OZ_Extension* extension);
+OZ_Extension* OZ_getExtension(OZ_Term term);
+OZ_Term OZ_mkByteString(const char* data, size_t size);
+
+OZ_Term OZ_newVariable();
+int OZ_protect(OZ_Term* term);
+int OZ_unprotect(OZ_Term* term);
+OZ_Return OZ_unify(OZ_Term left, OZ_Term right);
+OZ_Return OZ_suspendOnInternal(OZ_Term var);
+
+OZ_Return OZ_raiseErrorC(const char* label, int arity, ...);
+OZ_Return OZ_typeError(int position, const char* expected);
+void OZ_error(const char* format, ...);
+int oz_newUniqueId();
+
+/** Remember the current top of the term heap. */
+void stub_mark_heap();
+
+/** Free every term, and byte string, allocated since the last mark. Atoms are
+never freed. */
+void stub_reset_heap();
+
+//------------------------------------------------------------------------------
+// Builtins
+
+#define OZ_BI_define(Name, ArityIn, ArityOut) \
+    OZ_Return Name(OZ_Term* _OZ_LOC[]) \
+    { \
+        const int _OZ_arity_in = ArityIn; \
+        (void) _OZ_arity_in;
+#define OZ_BI_end }
+
+#define OZ_in(N) (*_OZ_LOC[N])
+#define OZ_out(N) (*_OZ_LOC[_OZ_arity_in + (N)])
+#define OZ_RETURN(V) return ((OZ_out(0) = (V)), OZ_ENTAILED)
+#define OZ_RETURN_INT(V) OZ_RETURN(OZ_int(V))
+
+#define OZ_declareDetTerm(N, V) \
+    OZ_Term V = OZ_deref(OZ_in(N)); \
+    if (OZ_isVariable(V)) \
+        return OZ_suspendOnInternal(V)
+#define OZ_declareTerm(N, V) OZ_Term V = OZ_in(N)
+
+#define OZ_declareType(N, V, T, Name, Is, Coerce) \
+    T V; \
+    { \
+        OZ_declareDetTerm(N, _oz_term); \
+        if (!Is(_oz_term)) \
+            return OZ_typeError(N, Name); \
+        V = Coerce(_oz_term); \
+    }
+
+#define OZ_declareInt(N, V) OZ_declareType(N, V, int, "Int", OZ_isInt, OZ_intToC)
+#define OZ_declareLong(N, V) OZ_declareType(N, V, long, "Int", OZ_isInt, OZ_intToCL)
+#define OZ_declareAtom(N, V) OZ_declareType(N, V, const char*, "Atom", OZ_isAtom, OZ_atomToC)
+#define OZ_declareVirtualString(N, V) \
+    char* V; \
+    { \
+        OZ_declareDetTerm(N, _oz_term); \
+        if (!OZ_isVirtualString(_oz_term, NULL)) \
+            return OZ_typeError(N, "VirtualString"); \
+        V = OZ_virtualStringToC(_oz_term, NULL); \
+    }
+#define OZ_declareByteString(N, V) \
+    OZ_declareType(N, V, ByteString*, "ByteString", OZ_isByteString, tagged2ByteString)
+
+typedef OZ_Return (*OZ_CFun)(OZ_Term**);
+
+struct OZ_C_proc_interface
+{
+    const char* name;
+    short inArity;
+    short outArity;
+    OZ_CFun func;
+};
+
+#endif
@@ -65,6 +65,11 @@ public:
 	//printf("statusReg = %#x\n", statusReg);
 	return statusReg & flag;
     }
+
+    void setSFlag(StatusBit flag)
+    {
+	statusReg |= flag;
+    }
 };
 
 extern AM am;
@@ -29,10 +29,24 @@
 
 #include <mozart.h>
 #include <zmq.h>
+#include <zlib.h>
 #include <pthread.h>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
 #include <time.h>
 #include <vector>
+#include <algorithm>
 #include <string>
+#include <set>
+#include <map>
+#include <list>
 #include <tr1/unordered_map>
 
 //#pragma GCC visibility push(hidden)
@@ -44,17 +58,10 @@ namespace Ozzero {
 //------------------------------------------------------------------------------
 //{{{ Utility functions
 
-/** Raise an Oz error. Use it like this inside an OZ_BI_define:
-
-    if (some bad condition)
-        return raise_error();
-    else
-        OZ_RETURN(etc);
-*/
-static OZ_Return raise_error()
+/** The first argument of a 'zmqError' for 'error_number': the name of the
+error as an atom, or the number itself if it has no name here. */
+static OZ_Term error_code(int error_number)
 {
-    int error_number = errno;
-    const char* error_message = strerror(error_number);
     const char* error_atom;
     switch (error_number)
     {
@@ -81,14 +88,92 @@ static OZ_Return raise_error()
         DEF_CASE(EINPROGRESS);
         DEF_CASE(EAFNOSUPPORT);
         DEF_CASE(EHOSTUNREACH);
+        DEF_CASE(EPROTO);
         default: error_atom = NULL; break;
     #undef DEF_CASE
     }
 
-    OZ_Term err_code = error_atom == NULL ? OZ_int(error_number) : OZ_atom(error_atom);
-    return OZ_raiseErrorC("zmqError", 2, err_code, OZ_atom(error_message));
+    return error_atom == NULL ? OZ_int(error_number) : OZ_atom(error_atom);
+}
+
+/** Raise an Oz error. Use it like this inside an OZ_BI_define:
+
+    if (some bad condition)
+        return raise_error();
+    else
+        OZ_RETURN(etc);
+*/
+static OZ_Return raise_error()
+{
+    int error_number = errno;
+    return OZ_raiseErrorC("zmqError", 2, error_code(error_number), OZ_atom(strerror(error_number)));
+}
+
+/** Read the monotonic clock in nanoseconds. */
+static inline uint64_t monotonic_ns()
+{
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+}
+
+static inline uint64_t monotonic_ms()
+{
+    return monotonic_ns() / 1000000;
 }
 
+/** Memory held outside the Mozart heap by live extensions: the payloads of open
+messages and the overflow spools of sockets. Mozart's GC cannot see it, so once
+it exceeds the budget a GC is requested, letting the finalizers of unreachable
+sockets and messages free it. If the memory is still in use after all, the
+next request waits until it has grown by another half budget. Only the emulator
+thread calls this. */
+struct OffHeapAccount
+{
+    int64_t message_bytes;
+    int64_t messages;
+    int64_t spool_bytes;
+    int64_t high_water;
+    /** 0 disables the GC requests. */
+    int64_t budget;
+    int64_t next_request;
+    uint64_t gc_requests;
+
+    OffHeapAccount()
+        : message_bytes(0), messages(0), spool_bytes(0), high_water(0),
+          budget(256 << 20), next_request(256 << 20), gc_requests(0) {}
+
+    int64_t total() const { return message_bytes + spool_bytes; }
+
+    void set_budget(int64_t new_budget)
+    {
+        budget = new_budget;
+        next_request = new_budget;
+    }
+
+    void charge(int64_t& counter, int64_t delta)
+    {
+        counter += delta;
+        int64_t current = total();
+        if (current > high_water)
+            high_water = current;
+
+        if (budget <= 0)
+            return;
+        if (current < budget)
+        {
+            next_request = budget;
+        }
+        else if (current >= next_request)
+        {
+            am.setSFlag(StartGC);
+            ++ gc_requests;
+            next_request = current + budget / 2;
+        }
+    }
+};
+
+static OffHeapAccount g_off_heap;
 
 
 /** Get an option value using the method (object->*getter). The type is
@@ -181,10 +266,35 @@ static inline OZ_Return set_opt_common(int type_pos, OZ_Term type_term,
     return OZ_ENTAILED;
 }
 
+#if ZMQ_VERSION >= 30100
+static const int OZZERO_DONTWAIT = ZMQ_DONTWAIT;
+static const long OZZERO_POLL_MSEC = 1;
+#else
+static const int OZZERO_DONTWAIT = ZMQ_NOBLOCK;
+static const long OZZERO_POLL_MSEC = 1000;     // zmq_poll takes microseconds
+#endif
+
 #define RETURN_WRONG_VERSION(funcname, reqver) \
     OZ_error("To use " #funcname ", please recompile with ZeroMQ v" reqver " or above."); \
     return -1
 
+/** Socket options implemented by ozzero itself instead of libzmq. They share
+'sockopt_map' with the ZMQ_* options, so they are numbered well above anything
+libzmq defines. */
+enum PrivateSocketOption
+{
+    OZZERO_OPT_BASE = 0x10000,
+    OZZERO_COMPRESS_THRESHOLD = OZZERO_OPT_BASE,
+    OZZERO_COMPRESS_LEVEL,
+    OZZERO_SPOOL_PATH,
+    OZZERO_SPOOL_SIZE,
+    OZZERO_BUSY_POLL,
+    OZZERO_PACE_MESSAGES,
+    OZZERO_PACE_BYTES,
+    OZZERO_PACE_BURST,
+    OZZERO_SHM_THRESHOLD
+};
+
 
 //{{{ Atom to integers
 
@@ -260,6 +370,16 @@ struct AtomDecoder
         sockopt_map.insert(std::make_pair("rcvtimeo", ZMQ_RCVTIMEO));
         sockopt_map.insert(std::make_pair("sndtimeo", ZMQ_SNDTIMEO));
 
+        sockopt_map.insert(std::make_pair("compressThreshold", OZZERO_COMPRESS_THRESHOLD));
+        sockopt_map.insert(std::make_pair("compressLevel", OZZERO_COMPRESS_LEVEL));
+        sockopt_map.insert(std::make_pair("spoolPath", OZZERO_SPOOL_PATH));
+        sockopt_map.insert(std::make_pair("spoolSize", OZZERO_SPOOL_SIZE));
+        sockopt_map.insert(std::make_pair("busyPoll", OZZERO_BUSY_POLL));
+        sockopt_map.insert(std::make_pair("paceMessages", OZZERO_PACE_MESSAGES));
+        sockopt_map.insert(std::make_pair("paceBytes", OZZERO_PACE_BYTES));
+        sockopt_map.insert(std::make_pair("paceBurst", OZZERO_PACE_BURST));
+        sockopt_map.insert(std::make_pair("shmThreshold", OZZERO_SHM_THRESHOLD));
+
     #if ZMQ_VERSION >= 30101
         ctx_getset_map.insert(std::make_pair("ioThreads", ZMQ_IO_THREADS));
         ctx_getset_map.insert(std::make_pair("maxSockets", ZMQ_MAX_SOCKETS));
@@ -313,6 +433,8 @@ class Message;
 static OZ_Return send_or_recv(Socket* socket, Message* msg, OZ_Term flags_term,
                               int (Message::*method)(Socket&, int),
                               OZ_Term& retval, OZ_Term& interrupted);
+static OZ_Return completion(int rc, OZ_Term& retval, OZ_Term& interrupted);
+static void collect_term_slots();
 
 //}}}
 //------------------------------------------------------------------------------
@@ -334,36 +456,306 @@ OZ_BI_define(ozzero_version, 0, 1)
 }
 OZ_BI_end
 
+//}}}
+//------------------------------------------------------------------------------
+//{{{ Tracing
+
+enum TraceOp
+{
+    TRACE_SEND,
+    TRACE_RECV,
+    TRACE_POLL,
+    TRACE_DEVICE,
+    TRACE_BIND,
+    TRACE_CONNECT,
+    TRACE_UNBIND,
+    TRACE_DISCONNECT,
+    TRACE_SETSOCKOPT,
+    TRACE_GETSOCKOPT
+};
+
+static const char* const g_trace_op_names[] = {
+    "send", "recv", "poll", "device", "bind", "connect", "unbind", "disconnect",
+    "setsockopt", "getsockopt"
+};
+
+struct TraceEvent
+{
+    /** One more than the index the event was recorded at, or 0 while it is
+    being written. */
+    uint64_t sequence;
+    uint64_t begin_ns;
+    uint64_t end_ns;
+    const void* socket;
+    int64_t result;
+    int op;
+    int error_number;
+};
+
+/** A fixed-size ring of the latest zmq calls. Writers claim a slot with an
+atomic increment and never wait, so the oldest events are simply overwritten. */
+class TraceRing
+{
+    TraceEvent* _events;
+    uint64_t _mask;
+    uint64_t _next;
+
+public:
+    explicit TraceRing(uint64_t capacity) : _next(0)
+    {
+        uint64_t size = 1;
+        while (size < capacity)
+            size <<= 1;
+        _mask = size - 1;
+        _events = new TraceEvent[size];
+        memset(_events, 0, sizeof(TraceEvent) * size);
+    }
+
+    ~TraceRing()
+    {
+        delete[] _events;
+    }
+
+    void record(TraceOp op, const void* socket, uint64_t begin_ns, int64_t result)
+    {
+        int saved_errno = errno;
+        int error_number = result < 0 ? saved_errno : 0;
+        uint64_t index = __sync_fetch_and_add(&_next, 1);
+        TraceEvent& event = _events[index & _mask];
+        event.sequence = 0;
+        __sync_synchronize();
+        event.begin_ns = begin_ns;
+        event.end_ns = monotonic_ns();
+        event.socket = socket;
+        event.result = result;
+        event.op = op;
+        event.error_number = error_number;
+        __sync_synchronize();
+        event.sequence = index + 1;
+        errno = saved_errno;
+    }
+
+    /** Write the events still in the ring, oldest first, as a Chrome trace
+    ("Trace Event Format") JSON file. Returns the number of events. */
+    int64_t dump(FILE* file) const
+    {
+        uint64_t end = _next;
+        uint64_t start = end > _mask ? end - _mask - 1 : 0;
+        int64_t count = 0;
+        int pid = getpid();
+
+        fputs("{\"traceEvents\":[", file);
+        for (uint64_t index = start; index < end; ++ index)
+        {
+            const TraceEvent& event = _events[index & _mask];
+            if (event.sequence != index + 1)
+                continue;       // overwritten or still being written
+
+            bool is_transfer = event.op == TRACE_SEND || event.op == TRACE_RECV;
+            fprintf(file, "%s\n{\"name\":\"%s\",\"cat\":\"zmq\",\"ph\":\"X\","
+                          "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,"
+                          "\"args\":{\"socket\":\"%p\",\"%s\":%" PRId64 ",\"errno\":%d}}",
+                    count == 0 ? "" : ",",
+                    g_trace_op_names[event.op],
+                    event.begin_ns / 1000.0, (event.end_ns - event.begin_ns) / 1000.0,
+                    pid, pid, event.socket,
+                    is_transfer ? "bytes" : "result",
+                    event.result < 0 ? -1 : event.result,
+                    event.error_number);
+            ++ count;
+        }
+        fputs("\n]}\n", file);
+        return count;
+    }
+};
+
+/** The trace ring, or NULL when tracing is off. */
+static TraceRing* g_trace_ring = NULL;
+
+/** Evaluate 'Call', an int expression, into 'Result', recording it in the
+trace ring if tracing is on. When it is off, this costs a single branch. */
+#define TRACED(Op, Socket, Result, Call) \
+    do { \
+        if (__builtin_expect(g_trace_ring == NULL, 1)) \
+        { \
+            Result = (Call); \
+        } \
+        else \
+        { \
+            uint64_t _xx_begin_ns = monotonic_ns(); \
+            Result = (Call); \
+            g_trace_ring->record(Op, Socket, _xx_begin_ns, Result); \
+        } \
+    } while (0)
+
+static inline int traced_poll(zmq_pollitem_t* items, int count, long timeout)
+{
+    int rc;
+    TRACED(TRACE_POLL, NULL, rc, zmq_poll(items, count, timeout));
+    return rc;
+}
+
+/** {ZN.traceStart +CapacityI}
+
+Start recording zmq calls into a ring of at least 'CapacityI' events, dropping
+whatever was recorded before.
+*/
+OZ_BI_define(ozzero_trace_start, 1, 0)
+{
+    OZ_declareLong(0, capacity);
+    if (capacity <= 0)
+        return OZ_typeError(0, "positive integer");
+
+    TraceRing* old_ring = g_trace_ring;
+    g_trace_ring = new TraceRing(static_cast<uint64_t>(capacity));
+    delete old_ring;
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+/** {ZN.traceStop} */
+OZ_BI_define(ozzero_trace_stop, 0, 0)
+{
+    TraceRing* ring = g_trace_ring;
+    g_trace_ring = NULL;
+    delete ring;
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+/** {ZN.traceDump +PathVS ?CountI}
+
+Write the recorded events to a JSON file which chrome://tracing (or Perfetto)
+can open. Recording goes on.
+*/
+OZ_BI_define(ozzero_trace_dump, 1, 1)
+{
+    OZ_declareVirtualString(0, path);
+    if (g_trace_ring == NULL)
+    {
+        errno = EINVAL;
+        return raise_error();
+    }
+
+    FILE* file = fopen(path, "w");
+    if (file == NULL)
+        return raise_error();
+    int64_t count = g_trace_ring->dump(file);
+    if (fclose(file) != 0)
+        return raise_error();
+    OZ_RETURN(OZ_int64(count));
+}
+OZ_BI_end
+
 //}}}
 //------------------------------------------------------------------------------
 //{{{ Context
 
+struct SocketState;
+
+/** Native state of a context, shared with the sockets created from it. It is
+freed once the context and all of those sockets have been closed. */
+struct ContextState
+{
+    void* handle;
+    int refcount;
+
+    /** Every open socket created from this context. */
+    std::set<SocketState*> sockets;
+
+    int io_threads;
+    unsigned next_thread;
+    std::vector<int> thread_sockets;
+    /** Bytes sent and received by the open sockets placed on each thread. */
+    std::vector<uint64_t> thread_bytes;
+    std::map<std::string, int> groups;
+
+    ContextState(void* handle_, int io_threads_)
+        : handle(handle_), refcount(1), next_thread(0)
+    {
+        set_io_threads(io_threads_);
+    }
+
+    void retain() { ++ refcount; }
+
+    void release()
+    {
+        if (-- refcount == 0)
+            delete this;
+    }
+
+    void set_io_threads(int count)
+    {
+        // ZMQ_AFFINITY is a 64-bit mask.
+        io_threads = std::max(1, std::min(count, 64));
+        // Never shrink the counters: existing sockets and groups keep the
+        // thread they were pinned to, even past the new count.
+        size_t slots = std::max(thread_sockets.size(), static_cast<size_t>(io_threads));
+        thread_sockets.resize(slots, 0);
+        thread_bytes.resize(slots, 0);
+    }
+
+    int least_loaded_thread() const
+    {
+        int best = 0;
+        for (int i = 1; i < io_threads; ++ i)
+        {
+            if (thread_bytes[i] < thread_bytes[best]
+                    || (thread_bytes[i] == thread_bytes[best]
+                        && thread_sockets[i] < thread_sockets[best]))
+                best = i;
+        }
+        return best;
+    }
+
+    int round_robin_thread()
+    {
+        return next_thread++ % io_threads;
+    }
+
+    /** Sockets of the same group always share an I/O thread. The first socket
+    of a group picks the least loaded one. */
+    int group_thread(const std::string& group)
+    {
+        std::map<std::string, int>::iterator it = groups.find(group);
+        if (it != groups.end())
+            return it->second;
+        int thread = least_loaded_thread();
+        groups.insert(std::make_pair(group, thread));
+        return thread;
+    }
+};
+
 int g_id_Context;
-class Context : public Extension<Context, void*, g_id_Context>
+class Context : public Extension<Context, ContextState*, g_id_Context>
 {
 public:
-    explicit Context(void* obj) : Extension(obj) {}
+    explicit Context(ContextState* obj) : Extension(obj) {}
 
     int close()
     {
-        void* obj = _obj;
-        if (obj == NULL)
+        ContextState* state = _obj;
+        if (state == NULL)
             return 0;
         _obj = NULL;
+        void* handle = state->handle;
+        state->handle = NULL;
+        state->release();
     #if ZMQ_VERSION >= 30101
-        return zmq_ctx_destroy(obj);
+        return zmq_ctx_destroy(handle);
     #else
-        return zmq_term(obj);
+        return zmq_term(handle);
     #endif
     }
 
     bool is_valid() const { return _obj != NULL; }
-    void* socket(int type) { return zmq_socket(_obj, type); }
+    void* socket(int type) { return zmq_socket(_obj->handle, type); }
+    ContextState& state() { return *_obj; }
 
     int get(int option)
     {
     #if ZMQ_VERSION >= 30101
-        return zmq_ctx_get(_obj, option);
+        return zmq_ctx_get(_obj->handle, option);
     #else
         RETURN_WRONG_VERSION(zmq_ctx_get, "3.1.1");
     #endif
@@ -372,7 +764,10 @@ public:
     int set(int option, int value)
     {
     #if ZMQ_VERSION >= 30101
-        return zmq_ctx_set(_obj, option, value);
+        int rc = zmq_ctx_set(_obj->handle, option, value);
+        if (rc == 0 && option == ZMQ_IO_THREADS)
+            _obj->set_io_threads(value);
+        return rc;
     #else
         RETURN_WRONG_VERSION(zmq_ctx_set, "3.1.1");
     #endif
@@ -382,7 +777,7 @@ public:
     {
         return OZ_mkTupleC("#", 3,
                            OZ_atom("<Z14.Context "),
-                           OZ_unsignedLong(reinterpret_cast<uintptr_t>(_obj)),
+                           OZ_unsignedLong(reinterpret_cast<uintptr_t>(_obj ? _obj->handle : NULL)),
                            OZ_atom(">"));
     }
 };
@@ -407,7 +802,7 @@ OZ_BI_define(ozzero_ctx_new, 1, 1)
         zmq_ctx_set(context, ZMQ_IO_THREADS, io_threads);
 #endif
 
-    OZ_RETURN(OZ_extension(new Context(context)));
+    OZ_RETURN(OZ_extension(new Context(new ContextState(context, io_threads))));
 }
 OZ_BI_end
 
@@ -426,7 +821,7 @@ OZ_BI_define(ozzero_ctx_get, 2, 1)
 {
     OZ_declare(Context, 0, context);
     ENSURE_VALID(Context, context);
-    OZ_declareAndDecode(g_atom_decoder.socket_type_map, "socket type", 1, option);
+    OZ_declareAndDecode(g_atom_decoder.ctx_getset_map, "context option", 1, option);
 
     int res = context->get(option);
     if (res < 0)
@@ -441,569 +836,5849 @@ OZ_BI_define(ozzero_ctx_set, 3, 0)
 {
     OZ_declare(Context, 0, context);
     ENSURE_VALID(Context, context);
-    OZ_declareAndDecode(g_atom_decoder.socket_type_map, "socket type", 1, option);
+    OZ_declareAndDecode(g_atom_decoder.ctx_getset_map, "context option", 1, option);
     OZ_declareInt(2, value);
 
     return checked(context->set(option, value));
 }
 OZ_BI_end
 
+/** {ZN.ctxThreadLoad +Context ?LoadL}
+
+Return 'thread(index:I sockets:N bytes:B)' for each I/O thread, counting only
+the open sockets pinned to it.
+*/
+OZ_BI_define(ozzero_ctx_thread_load, 1, 1)
+{
+    OZ_declare(Context, 0, context);
+    ENSURE_VALID(Context, context);
+    const ContextState& state = context->state();
+
+    std::vector<OZ_Term> load_terms;
+    for (int i = 0; i < state.io_threads; ++ i)
+    {
+        OZ_Term props[] = {
+            OZ_pairAI("index", i),
+            OZ_pairAI("sockets", state.thread_sockets[i]),
+            OZ_pairA("bytes", OZ_uint64(state.thread_bytes[i])),
+        };
+        OZ_Term prop_list = OZ_toList(sizeof(props)/sizeof(*props), props);
+        load_terms.push_back(OZ_recordInitC("thread", prop_list));
+    }
+    OZ_RETURN(OZ_toList(load_terms.size(), load_terms.data()));
+}
+OZ_BI_end
+
 //}}}
 //------------------------------------------------------------------------------
 //{{{ Socket
 
-int g_id_Socket;
-class Socket : public Extension<Socket, void*, g_id_Socket>
+//{{{ Frame compression
+
+/** When compression or shared memory handoff is enabled on a socket, every
+frame sent or received by it starts with one of these flag bytes, so small and
+incompressible frames can be mixed with compressed ones. */
+enum
 {
-public:
-    explicit Socket(void* obj) : Extension(obj) {}
+    FRAME_RAW = 0,
+    FRAME_ZLIB = 1,
+    FRAME_SHM = 2
+};
 
-    int close() {
-        void* obj = _obj;
-        if (obj == NULL)
-            return 0;
-        _obj = NULL;
-        return zmq_close(obj);
-    }
+/** A zlib frame is the flag byte, then the uncompressed length as a 32-bit
+big-endian integer, then the deflate stream. */
+static const size_t ZLIB_HEADER_SIZE = 5;
 
-    virtual OZ_Term printV(int depth)
-    {
-        return OZ_mkTupleC("#", 3,
-                           OZ_atom("<Z14.Socket "),
-                           OZ_unsignedLong(reinterpret_cast<uintptr_t>(_obj)),
-                           OZ_atom(">"));
-    }
+/** Deflate never expands data more than this many times, so a zlib frame
+claiming a larger length is forged and refused before anything is allocated. */
+static const uint64_t ZLIB_MAX_RATIO = 1032;
 
-    bool is_valid() const { return _obj != NULL; }
+static void free_malloced(void* data, void*)
+{
+    free(data);
+}
+
+/** Replace the content of 'msg' with 'encoded', leaving 'encoded' closed. */
+static void replace_frame(zmq_msg_t* msg, zmq_msg_t* encoded)
+{
+    zmq_msg_move(msg, encoded);
+    zmq_msg_close(encoded);
+}
+
+struct SocketStats
+{
+    uint64_t frames_sent;
+    uint64_t frames_received;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+
+    uint64_t compressed_frames;
+    uint64_t compress_bytes_in;
+    uint64_t compress_bytes_out;
+    uint64_t compress_ns;
+    uint64_t decompressed_frames;
+    uint64_t decompress_ns;
+
+    uint64_t spooled_frames;
+    uint64_t drained_frames;
+    uint64_t spool_rejected;
+
+    uint64_t conflated_messages;
+
+    uint64_t throttled_sends;
+    uint64_t throttled_ns;
+
+    uint64_t shm_frames_sent;
+    uint64_t shm_bytes_sent;
+    uint64_t shm_frames_received;
+};
 
-    int setsockopt(int name, const void* value, size_t length) { return zmq_setsockopt(_obj, name, value, length); }
-    int getsockopt(int name, void* value, size_t* length) { return zmq_getsockopt(_obj, name, value, length); }
-    int bind(const char* addr) { return zmq_bind(_obj, addr); }
-    int connect(const char* addr) { return zmq_connect(_obj, addr); }
+/** Prepend the flag byte to 'msg', compressing it with zlib if it is at least
+'threshold' bytes long and compression actually makes it smaller. */
+static int encode_frame(zmq_msg_t* msg, int threshold, int level, SocketStats& stats)
+{
+    size_t size = zmq_msg_size(msg);
+    const Bytef* data = static_cast<const Bytef*>(zmq_msg_data(msg));
+    zmq_msg_t encoded;
 
-    int unbind(const char* addr)
+    if (size >= static_cast<size_t>(threshold) && size <= 0xffffffffUL)
     {
-    #if ZMQ_VERSION >= 30101
-        return zmq_unbind(_obj, addr);
-    #else
-        RETURN_WRONG_VERSION(zmq_unbind, "3.1.1");
-    #endif
+        uint64_t start_ns = monotonic_ns();
+        uLongf compressed_size = compressBound(size);
+        Bytef* buffer = static_cast<Bytef*>(malloc(ZLIB_HEADER_SIZE + compressed_size));
+        if (buffer == NULL)
+        {
+            errno = ENOMEM;
+            return -1;
+        }
+
+        int zrc = compress2(buffer + ZLIB_HEADER_SIZE, &compressed_size, data, size, level);
+        stats.compress_ns += monotonic_ns() - start_ns;
+
+        if (zrc == Z_OK && compressed_size + ZLIB_HEADER_SIZE <= size)
+        {
+            buffer[0] = FRAME_ZLIB;
+            buffer[1] = static_cast<Bytef>(size >> 24);
+            buffer[2] = static_cast<Bytef>(size >> 16);
+            buffer[3] = static_cast<Bytef>(size >> 8);
+            buffer[4] = static_cast<Bytef>(size);
+
+            size_t encoded_size = ZLIB_HEADER_SIZE + compressed_size;
+            if (zmq_msg_init_data(&encoded, buffer, encoded_size, free_malloced, NULL) != 0)
+            {
+                free(buffer);
+                return -1;
+            }
+
+            ++ stats.compressed_frames;
+            stats.compress_bytes_in += size;
+            stats.compress_bytes_out += encoded_size;
+            replace_frame(msg, &encoded);
+            return 0;
+        }
+
+        free(buffer);
     }
 
-    int disconnect(const char* addr)
+    if (zmq_msg_init_size(&encoded, size + 1) != 0)
+        return -1;
+    unsigned char* encoded_data = static_cast<unsigned char*>(zmq_msg_data(&encoded));
+    encoded_data[0] = FRAME_RAW;
+    memcpy(encoded_data + 1, data, size);
+    replace_frame(msg, &encoded);
+    return 0;
+}
+
+static int decode_shm_frame(zmq_msg_t* msg, SocketStats& stats);
+
+/** Reverse of encode_frame, and of encode_shm_frame. Fails with EPROTO if the
+frame does not start with a valid flag byte, would inflate to more than
+'max_size' bytes, or refers to shared memory while 'allow_shm' is false. */
+static int decode_frame(zmq_msg_t* msg, uint64_t max_size, bool allow_shm, SocketStats& stats)
+{
+    size_t size = zmq_msg_size(msg);
+    const Bytef* data = static_cast<const Bytef*>(zmq_msg_data(msg));
+    zmq_msg_t decoded;
+
+    if (size >= 1 && data[0] == FRAME_RAW)
     {
-    #if ZMQ_VERSION >= 30101
-        return zmq_disconnect(_obj, addr);
-    #else
-        RETURN_WRONG_VERSION(zmq_disconnect, "3.1.1");
-    #endif
+        if (zmq_msg_init_size(&decoded, size - 1) != 0)
+            return -1;
+        memcpy(zmq_msg_data(&decoded), data + 1, size - 1);
     }
-};
+    else if (size >= ZLIB_HEADER_SIZE && data[0] == FRAME_ZLIB)
+    {
+        uLongf original_size = static_cast<uLongf>(data[1]) << 24 | data[2] << 16
+                             | data[3] << 8 | data[4];
+        if (original_size > max_size
+            || original_size > (size - ZLIB_HEADER_SIZE) * ZLIB_MAX_RATIO)
+        {
+            errno = EPROTO;
+            return -1;
+        }
+        if (zmq_msg_init_size(&decoded, original_size) != 0)
+            return -1;
 
-/** {ZN.socket +Context +TypeA ?Socket} */
-OZ_BI_define(ozzero_socket, 2, 1)
-{
-    OZ_declare(Context, 0, context);
-    ENSURE_VALID(Context, context);
-    OZ_declareAndDecode(g_atom_decoder.socket_type_map, "socket type", 1, type);
+        uint64_t start_ns = monotonic_ns();
+        uLongf decompressed_size = original_size;
+        int zrc = uncompress(static_cast<Bytef*>(zmq_msg_data(&decoded)), &decompressed_size,
+                             data + ZLIB_HEADER_SIZE, size - ZLIB_HEADER_SIZE);
+        stats.decompress_ns += monotonic_ns() - start_ns;
 
-    void* socket = context->socket(type);
-    if (socket == NULL)
-        return raise_error();
+        if (zrc != Z_OK || decompressed_size != original_size)
+        {
+            zmq_msg_close(&decoded);
+            errno = EPROTO;
+            return -1;
+        }
+        ++ stats.decompressed_frames;
+    }
+    else if (size >= 1 && data[0] == FRAME_SHM && allow_shm)
+        return decode_shm_frame(msg, stats);
     else
-        OZ_RETURN(OZ_extension(new Socket(socket)));
-}
-OZ_BI_end
+    {
+        errno = EPROTO;
+        return -1;
+    }
 
-/** {ZN.close +Socket} */
-OZ_BI_define(ozzero_close, 1, 0)
-{
-    OZ_declare(Socket, 0, socket);
-    return checked(socket->close());
+    replace_frame(msg, &decoded);
+    return 0;
 }
-OZ_BI_end
 
-/** {ZN.setsockopt +Socket +OptA +TypeA +Term}
+//}}}
 
-where TypeA should be one of 'int', 'int64', 'uint64' or other things (which
-will be interpreted as 'byteString').
-*/
-OZ_BI_define(ozzero_setsockopt, 4, 1)
+//{{{ Shared memory handoff
+
+/** A frame placed in shared memory is sent as this descriptor instead: the
+flag byte, the payload size as a 64-bit big-endian integer, then the name of
+the POSIX shared memory object holding the payload. */
+static const size_t SHM_HEADER_SIZE = 9;
+
+/** Unmap a received payload once libzmq is done with its frame. The size is
+passed as the hint. */
+static void unmap_shm(void* data, void* hint)
 {
-    OZ_declare(Socket, 0, socket);
-    ENSURE_VALID(Socket, socket);
-    OZ_declareAndDecode(g_atom_decoder.sockopt_map, "socket option", 1, real_name);
-    OZ_declareDetTerm(2, type_term);
-    return set_opt_common(2, type_term, real_name, OZ_in(3), OZ_out(0),
-                          socket, &Socket::setsockopt);
+    munmap(data, reinterpret_cast<size_t>(hint));
 }
-OZ_BI_end
-
-/** {ZN.getsockopt +Socket +OptA +TypeA ?Term}
 
-where TypeA should be one of 'int', 'int64', 'uint64' or an integer (which will
-be interpreted as a 'byteString' with a maximum length).
-*/
-OZ_BI_define(ozzero_getsockopt, 3, 1)
+/** Copy 'msg' into a new shared memory object, and replace it by the
+descriptor of that object. The object is unlinked by the receiver once it has
+mapped it; the sender keeps no trace of it, as a frame may still be delivered
+after its socket is closed. An object whose frame is never received, e.g.
+because the peer went away, is left in the shared memory namespace. */
+static int encode_shm_frame(zmq_msg_t* msg, SocketStats& stats)
 {
-    OZ_declare(Socket, 0, socket);
-    ENSURE_VALID(Socket, socket);
-    OZ_declareAndDecode(g_atom_decoder.sockopt_map, "socket option", 1, real_name);
-    OZ_declareDetTerm(2, type_term);
-    return get_opt_common(2, type_term, real_name, OZ_out(0),
-                          socket, &Socket::getsockopt);
+    static unsigned long counter = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "/ozzero-%d-%lu", static_cast<int>(getpid()), ++ counter);
+
+    size_t size = zmq_msg_size(msg);
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return -1;
+
+    void* data = MAP_FAILED;
+    if (ftruncate(fd, size) == 0)
+        data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int error_number = errno;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        shm_unlink(name);
+        errno = error_number;
+        return -1;
+    }
+    memcpy(data, zmq_msg_data(msg), size);
+    munmap(data, size);
+
+    size_t name_length = strlen(name);
+    zmq_msg_t encoded;
+    if (zmq_msg_init_size(&encoded, SHM_HEADER_SIZE + name_length) != 0)
+    {
+        error_number = errno;
+        shm_unlink(name);
+        errno = error_number;
+        return -1;
+    }
+    unsigned char* header = static_cast<unsigned char*>(zmq_msg_data(&encoded));
+    header[0] = FRAME_SHM;
+    for (int i = 0; i < 8; ++ i)
+        header[1 + i] = static_cast<unsigned char>(static_cast<uint64_t>(size) >> (56 - 8 * i));
+    memcpy(header + SHM_HEADER_SIZE, name, name_length);
+
+    ++ stats.shm_frames_sent;
+    stats.shm_bytes_sent += size;
+    replace_frame(msg, &encoded);
+    return 0;
 }
-OZ_BI_end
 
-/** {ZN.bind +Socket +AddrVS}
-    {ZN.connect +Socket +AddrVS}
-    {ZN.unbind +Socket +AddrVS}
-    {ZN.disconnect +Socket +AddrVS}
-*/
-#define DEFINE_CONNECT_FUNC(NAME) \
-    OZ_BI_define(ozzero_##NAME, 2, 0) \
-    { \
-        OZ_declare(Socket, 0, socket); \
-        ENSURE_VALID(Socket, socket); \
-        OZ_declareVirtualString(1, addr); \
-        return checked(socket->NAME(addr)); \
-    } \
-    OZ_BI_end
+/** Whether 'name' has the form of the names encode_shm_frame generates,
+"/ozzero-<pid>-<counter>". Descriptors come from peers, so anything else is
+refused rather than opened, and unlinked. */
+static bool is_shm_frame_name(const std::string& name)
+{
+    static const char prefix[] = "/ozzero-";
+    static const size_t prefix_length = sizeof(prefix) - 1;
+    if (name.compare(0, prefix_length, prefix) != 0)
+        return false;
+
+    size_t dash = name.find('-', prefix_length);
+    if (dash == std::string::npos || dash == prefix_length || dash + 1 == name.size())
+        return false;
+    for (size_t i = prefix_length; i < name.size(); ++ i)
+    {
+        if (i != dash && (name[i] < '0' || name[i] > '9'))
+            return false;
+    }
+    return true;
+}
 
-DEFINE_CONNECT_FUNC(bind)
-DEFINE_CONNECT_FUNC(connect)
-DEFINE_CONNECT_FUNC(unbind)
-DEFINE_CONNECT_FUNC(disconnect)
+/** Map the payload a descriptor frame refers to, and replace the descriptor
+by a frame viewing that mapping. The object is unlinked at once; its memory is
+reclaimed when the frame is closed. */
+static int decode_shm_frame(zmq_msg_t* msg, SocketStats& stats)
+{
+    size_t size = zmq_msg_size(msg);
+    const unsigned char* header = static_cast<const unsigned char*>(zmq_msg_data(msg));
+    if (size <= SHM_HEADER_SIZE || size - SHM_HEADER_SIZE >= NAME_MAX)
+    {
+        errno = EPROTO;
+        return -1;
+    }
 
-#undef DEFINE_CONNECT_FUNC
+    uint64_t payload_size = 0;
+    for (int i = 0; i < 8; ++ i)
+        payload_size = payload_size << 8 | header[1 + i];
+    std::string name(reinterpret_cast<const char*>(header + SHM_HEADER_SIZE), size - SHM_HEADER_SIZE);
+    if (!is_shm_frame_name(name))
+    {
+        errno = EPROTO;
+        return -1;
+    }
+
+    int fd = shm_open(name.c_str(), O_RDONLY, 0);
+    if (fd < 0)
+        return -1;
+    shm_unlink(name.c_str());
+
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) != 0)
+        ;
+    else if (payload_size == 0 || static_cast<uint64_t>(st.st_size) != payload_size)
+        errno = EPROTO;
+    else
+        // Private, so the receiver may change the frame without the sender
+        // ever seeing it.
+        data = mmap(NULL, payload_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    int error_number = errno;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        errno = error_number;
+        return -1;
+    }
+
+    zmq_msg_t decoded;
+    if (zmq_msg_init_data(&decoded, data, payload_size, unmap_shm,
+                          reinterpret_cast<void*>(static_cast<size_t>(payload_size))) != 0)
+    {
+        error_number = errno;
+        munmap(data, payload_size);
+        errno = error_number;
+        return -1;
+    }
+
+    ++ stats.shm_frames_received;
+    replace_frame(msg, &decoded);
+    return 0;
+}
 
 //}}}
-//------------------------------------------------------------------------------
-//{{{ Message
 
-int g_id_Message;
-class Message : public ExtensionBase<Message, zmq_msg_t, g_id_Message>
+//{{{ Overflow spool
+
+/** An append-only ring of frames in a memory-mapped file. A socket with a
+spool appends the frames libzmq refuses with EAGAIN to it, and sends them again
+in order once the socket becomes writable. The file is unlinked as soon as it is
+created and its size is fixed, so it never outlives the socket nor grows. */
+class Spool
 {
-private:
-    bool _closed;
+    struct RecordHeader
+    {
+        uint32_t size;
+        uint32_t more;
+    };
+
+    /** 'size' of a record telling the reader to continue from the start. */
+    static const uint32_t WRAP = 0xffffffffU;
 
-    Message(zmq_msg_t* src, bool by_copy) : _closed(false)
+    int _fd;
+    char* _base;
+    size_t _capacity;
+    size_t _head;
+    size_t _tail;
+    size_t _count;
+    size_t _used;
+
+    Spool(int fd, char* base, size_t capacity)
+        : _fd(fd), _base(base), _capacity(capacity),
+          _head(0), _tail(0), _count(0), _used(0) {}
+
+    static size_t record_size(size_t size)
     {
-        zmq_msg_init(&_obj);
-        int rc = by_copy ? zmq_msg_copy(&_obj, src) : zmq_msg_move(&_obj, src);
-        if (rc == 0)
-            return;
-        char errstr[48];
-        snprintf(errstr, sizeof(errstr), "Fail to copy message (Error #%d)", errno);
-        Assert(buffer);
+        return (sizeof(RecordHeader) + size + 7) & ~static_cast<size_t>(7);
+    }
+
+    RecordHeader* header_at(size_t offset)
+    {
+        return reinterpret_cast<RecordHeader*>(_base + offset);
+    }
+
+    /** Skip the unused space at the end of the file, if the head is there. */
+    void normalize_head()
+    {
+        if (_capacity - _head < sizeof(RecordHeader) || header_at(_head)->size == WRAP)
+            _head = 0;
     }
 
 public:
-    virtual OZ_Extension* gCollectV() { _closed = true; return new Message(&_obj, /*by_copy*/false); }
-    virtual OZ_Extension* sCloneV() { return new Message(&_obj, /*by_copy*/true); }
-    // ^ should we allow this? Or do an Assert(0)?
+    /** Create a spool of 'capacity' bytes in a new file of the directory
+    'directory'. Returns NULL and sets errno on failure. */
+    static Spool* create(const std::string& directory, size_t capacity)
+    {
+        capacity &= ~static_cast<size_t>(7);
+        if (capacity < 2 * sizeof(RecordHeader))
+        {
+            errno = EINVAL;
+            return NULL;
+        }
 
-    Message() : _closed(true) {}
+        std::string path = directory + "/ozzero-spool-XXXXXX";
+        std::vector<char> path_buffer(path.begin(), path.end());
+        path_buffer.push_back('\0');
+        int fd = mkstemp(&path_buffer[0]);
+        if (fd < 0)
+            return NULL;
+        unlink(&path_buffer[0]);
 
-    ~Message() { close(); }
+        int rc = posix_fallocate(fd, 0, capacity);
+        if (rc != 0)
+        {
+            ::close(fd);
+            errno = rc;
+            return NULL;
+        }
 
-    int close()
+        void* base = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (base == MAP_FAILED)
+        {
+            int error_number = errno;
+            ::close(fd);
+            errno = error_number;
+            return NULL;
+        }
+
+        return new Spool(fd, static_cast<char*>(base), capacity);
+    }
+
+    ~Spool()
     {
-        if (_closed)
-            return 0;
-        _closed = true;
-        return zmq_msg_close(&_obj);
+        g_off_heap.charge(g_off_heap.spool_bytes, -static_cast<int64_t>(_used));
+        munmap(_base, _capacity);
+        ::close(_fd);
     }
 
-    bool is_valid() const { return !_closed; }
+    bool empty() const { return _count == 0; }
+    size_t count() const { return _count; }
+    size_t used() const { return _used; }
+    size_t capacity() const { return _capacity; }
 
-    int init()
+    /** Append a frame. Returns false if there is not enough room. */
+    bool push(const void* data, size_t size, bool more)
     {
-        int rc = zmq_msg_init(&_obj);
-        _closed = (rc != 0);
-        return rc;
+        size_t need = record_size(size);
+        if (size >= WRAP || need > _capacity)
+            return false;
+
+        bool wrapped = _tail < _head || (_tail == _head && _count > 0);
+        size_t position;
+        if (wrapped)
+        {
+            if (_head - _tail < need)
+                return false;
+            position = _tail;
+        }
+        else if (_capacity - _tail >= need)
+        {
+            position = _tail;
+        }
+        else if (_head >= need)
+        {
+            if (_capacity - _tail >= sizeof(RecordHeader))
+                header_at(_tail)->size = WRAP;
+            position = 0;
+        }
+        else
+        {
+            return false;
+        }
+
+        RecordHeader* header = header_at(position);
+        header->size = static_cast<uint32_t>(size);
+        header->more = more;
+        memcpy(header + 1, data, size);
+
+        _tail = position + need;
+        _used += need;
+        g_off_heap.charge(g_off_heap.spool_bytes, need);
+        ++ _count;
+        return true;
     }
 
-    int init_size(size_t size)
+    /** Peek at the oldest frame. The spool must not be empty. */
+    void front(const char*& data, size_t& size, bool& more)
     {
-        int rc = zmq_msg_init_size(&_obj, size);
-        _closed = (rc != 0);
-        return rc;
+        normalize_head();
+        RecordHeader* header = header_at(_head);
+        data = reinterpret_cast<const char*>(header + 1);
+        size = header->size;
+        more = header->more != 0;
     }
 
-    // What about zmq_msg_init_data?
+    /** Remove the oldest frame. The spool must not be empty. */
+    void pop()
+    {
+        normalize_head();
+        size_t need = record_size(header_at(_head)->size);
+        _head += need;
+        _used -= need;
+        g_off_heap.charge(g_off_heap.spool_bytes, -static_cast<int64_t>(need));
+        if (-- _count == 0)
+            _head = _tail = 0;
+    }
+};
 
-    size_t size() { return zmq_msg_size(&_obj); }
-    void* data() { return zmq_msg_data(&_obj); }
-    int copy(Message& other) { return zmq_msg_copy(&_obj, &other._obj); }
-    int move(Message& other) { return zmq_msg_move(&_obj, &other._obj); }
+//}}}
 
-    void set_data(const void* new_data, size_t new_size)
+//{{{ Pacing
+
+/** A token bucket for each of messages and bytes, limiting the rate at which a
+socket sends. Each bucket holds up to 'burst_ms' milliseconds worth of its rate
+(but at least one message, or one byte), and starts full. Only the first frame
+of a message has to wait: it needs a whole message token and a nonnegative byte
+balance. Every frame then takes its size from the byte bucket, which may go
+into debt, so a frame larger than the bucket is still sent and simply delays
+the next message. A rate of zero disables that bucket. */
+class Pacer
+{
+    double _msg_tokens;
+    double _byte_tokens;
+    uint64_t _refilled_ns;
+    bool _in_message;
+
+    /** When the refused send which started the current throttled period was
+    made, or 0 if the socket is not throttled. */
+    uint64_t _throttled_since;
+
+    /** Becomes readable when the bucket has refilled, for the Oz side to wait
+    on. Created on first use. */
+    int _timer_fd;
+
+    double capacity(int rate, double minimum) const
     {
-        void* old_data = zmq_msg_data(&_obj);
-        memcpy(old_data, new_data, new_size);
+        return std::max(static_cast<double>(rate) * std::max(burst_ms, 0) / 1000.0, minimum);
     }
 
-    int get(int name)
+    void refill(uint64_t now)
     {
-    #if ZMQ_VERSION >= 30101
-        return zmq_msg_get(&_obj, name);
-    #elif ZMQ_VERSION >= 30100
-        int retval;
-        size_t length = sizeof(retval);
-        int errcode = zmq_getmsgopt(&_obj, name, &retval, &length);
-        return errcode < 0 ? errcode : retval;
-    #else
-        RETURN_WRONG_VERSION(zmq_msg_get, "3.1.0");
-    #endif
+        if (_refilled_ns == 0)
+        {
+            _msg_tokens = capacity(msg_rate, 1);
+            _byte_tokens = capacity(byte_rate, 1);
+        }
+        else if (now > _refilled_ns)
+        {
+            double elapsed = (now - _refilled_ns) / 1e9;
+            _msg_tokens = std::min(_msg_tokens + elapsed * msg_rate, capacity(msg_rate, 1));
+            _byte_tokens = std::min(_byte_tokens + elapsed * byte_rate, capacity(byte_rate, 1));
+        }
+        _refilled_ns = now;
     }
 
-    int set(int name, int value)
+public:
+    int msg_rate;
+    int byte_rate;
+    int burst_ms;
+
+    Pacer()
+        : _msg_tokens(0), _byte_tokens(0), _refilled_ns(0), _in_message(false),
+          _throttled_since(0), _timer_fd(-1), msg_rate(0), byte_rate(0), burst_ms(10)
+    {}
+
+    ~Pacer()
     {
-    #if ZMQ_VERSION >= 30101
-        return zmq_msg_set(&_obj, name, value);
-    #else
-        RETURN_WRONG_VERSION(zmq_msg_set, "3.1.1");
-    #endif
+        if (_timer_fd >= 0)
+            close(_timer_fd);
     }
 
-    int recv(Socket& socket, int flags)
+    bool enabled() const { return msg_rate > 0 || byte_rate > 0; }
+
+    /** Start over with full buckets, after the rates have changed. */
+    void reset()
     {
-    #if ZMQ_VERSION >= 30101
-        return zmq_msg_recv(&_obj, socket._obj, flags);
-    #elif ZMQ_VERSION >= 30100
-        return zmq_recvmsg(socket._obj, &_obj, flags);
-    #else
-        return zmq_recv(socket._obj, &_obj, flags);
-    #endif
+        _refilled_ns = 0;
+        _throttled_since = 0;
     }
 
-    int send(Socket& socket, int flags)
+    /** How many nanoseconds a frame has to wait before it can be sent, 0 if
+    it can be sent now. */
+    uint64_t delay()
     {
-    #if ZMQ_VERSION >= 30101
-        return zmq_msg_send(&_obj, socket._obj, flags);
-    #elif ZMQ_VERSION >= 30100
-        return zmq_sendmsg(socket._obj, &_obj, flags);
-    #else
-        return zmq_send(socket._obj, &_obj, flags);
-    #endif
+        if (!enabled() || _in_message)
+            return 0;
+
+        refill(monotonic_ns());
+        double wait = 0;
+        if (msg_rate > 0 && _msg_tokens < 1)
+            wait = (1 - _msg_tokens) / msg_rate;
+        if (byte_rate > 0 && _byte_tokens < 0)
+            wait = std::max(wait, -_byte_tokens / byte_rate);
+        return wait <= 0 ? 0 : static_cast<uint64_t>(wait * 1e9) + 1;
     }
 
-    virtual OZ_Term printV(int depth)
+    /** Count a send attempt which had to wait 'delay' nanoseconds. The time
+    from the first refused attempt to the next accepted one is counted as
+    throttled. */
+    void record(uint64_t delay, SocketStats& stats)
     {
-        return OZ_mkTupleC("#", 3,
-                           OZ_atom("<Z14.Message "),
-                           OZ_mkByteString(static_cast<char*>(data()), size()),
-                           OZ_atom(">"));
+        if (delay > 0)
+        {
+            ++ stats.throttled_sends;
+            if (_throttled_since == 0)
+                _throttled_since = _refilled_ns;
+        }
+        else if (_throttled_since != 0)
+        {
+            stats.throttled_ns += _refilled_ns - _throttled_since;
+            _throttled_since = 0;
+        }
+    }
+
+    /** Take a frame that libzmq has accepted out of the buckets. */
+    void consume(size_t size, bool more)
+    {
+        if (!enabled())
+            return;
+        if (!_in_message && msg_rate > 0)
+            _msg_tokens -= 1;
+        if (byte_rate > 0)
+            _byte_tokens -= static_cast<double>(size);
+        _in_message = more;
+    }
+
+    /** Arm the timer to fire once the next message may be sent, and return
+    its descriptor, or -1 if the platform has no timerfd. */
+    int arm(uint64_t delay_ns)
+    {
+    #ifdef __linux__
+        if (_timer_fd < 0)
+        {
+            _timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+            if (_timer_fd < 0)
+                return -1;
+        }
+
+        uint64_t expirations;
+        while (read(_timer_fd, &expirations, sizeof(expirations)) > 0)
+            ;
+
+        itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        spec.it_value.tv_sec = delay_ns / 1000000000ULL;
+        spec.it_value.tv_nsec = delay_ns % 1000000000ULL;
+        if (timerfd_settime(_timer_fd, 0, &spec, NULL) != 0)
+            return -1;
+        return _timer_fd;
+    #else
+        (void) delay_ns;
+        errno = ENOTSUP;
+        return -1;
+    #endif
     }
 };
 
-/** {ZN.msgInit +Message} */
-OZ_BI_define(ozzero_msg_init, 1, 0)
-{
-    OZ_declare(Message, 0, msg);
-    return checked(msg->init());
-}
-OZ_BI_end
+//}}}
 
-/** {ZN.msgInitSize +Size +Message} */
-OZ_BI_define(ozzero_msg_init_size, 2, 0)
-{
-    OZ_declare(Message, 0, msg);
-    OZ_declareLong(1, size);
-    if (size < 0)
-        return OZ_typeError(0, "nonnegative integer");
-    return checked(msg->init_size(static_cast<size_t>(size)));
-}
-OZ_BI_end
+//{{{ Traffic capture
 
-/** {ZN.msgCreate ?Message} */
-OZ_BI_define(ozzero_msg_create, 0, 1)
-{
-    OZ_RETURN(OZ_extension(new Message()));
-}
-OZ_BI_end
+/** A capture log starts with this magic, and then has a CaptureRecord and the
+data of every frame, in the byte order of the machine which wrote it. */
+static const char CAPTURE_MAGIC[8] = {'O', 'Z', 'C', 'A', 'P', '0', '0', '1'};
 
-/** {ZN.msgClose +Message} */
-OZ_BI_define(ozzero_msg_close, 1, 0)
+enum
 {
-    OZ_declare(Message, 0, msg);
-    return checked(msg->close());
-}
-OZ_BI_end
+    CAPTURE_MORE = 1,
+    CAPTURE_RECEIVED = 2
+};
 
-/** {ZN.msgSize +Message ?Size} */
-OZ_BI_define(ozzero_msg_size, 1, 1)
+struct CaptureRecord
 {
-    OZ_declare(Message, 0, msg);
-    ENSURE_VALID(Message, msg);
-    OZ_RETURN_INT(msg->size());
-}
-OZ_BI_end
+    /** Nanoseconds since the capture was started. */
+    uint64_t time_ns;
+    uint32_t size;
+    uint32_t flags;
+};
 
-/** {ZN.msgData +Message ?DataByteString} */
-OZ_BI_define(ozzero_msg_data, 1, 1)
+/** Appends the frames a socket sends and receives to a capture log, through a
+buffer so that most frames cost a memcpy rather than a system call. Frames are
+recorded as they are on the wire, i.e. after compression. A write error, or a
+frame too large for a record (EMSGSIZE), stops the capture and is reported when
+it is stopped. */
+class CaptureLog
 {
-    OZ_declare(Message, 0, msg);
-    ENSURE_VALID(Message, msg);
-    const char* data = static_cast<const char*>(msg->data());
-    OZ_RETURN(OZ_mkByteString(data, msg->size()));
-}
-OZ_BI_end
+    static const size_t BUFFER_SIZE = 256 << 10;
 
-/** {ZN.msgMove +DestMessage +SrcMessage} */
-OZ_BI_define(ozzero_msg_move, 2, 0)
-{
-    OZ_declare(Message, 0, dest);
-    ENSURE_VALID(Message, dest);
-    OZ_declare(Message, 1, src);
-    ENSURE_VALID(Message, src);
-    return checked(dest->move(*src));
-}
-OZ_BI_end
+    int _fd;
+    char* _buffer;
+    size_t _used;
+    uint64_t _start_ns;
+    int _error;
+
+    bool write_all(const char* data, size_t size)
+    {
+        while (size > 0 && _error == 0)
+        {
+            ssize_t written = write(_fd, data, size);
+            if (written < 0)
+            {
+                if (errno != EINTR)
+                    _error = errno;
+                continue;
+            }
+            data += written;
+            size -= written;
+        }
+        return _error == 0;
+    }
+
+    CaptureLog(int fd) : _fd(fd), _buffer(new char[BUFFER_SIZE]), _used(0),
+                         _start_ns(monotonic_ns()), _error(0), frames(0), bytes(0)
+    {}
+
+public:
+    uint64_t frames;
+    uint64_t bytes;
+
+    static CaptureLog* create(const char* path)
+    {
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+            return NULL;
+        CaptureLog* log = new CaptureLog(fd);
+        log->append(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+        return log;
+    }
+
+    ~CaptureLog()
+    {
+        flush();
+        close(_fd);
+        delete[] _buffer;
+    }
+
+    /** The errno of the first failed write, or 0. */
+    int error() const { return _error; }
+
+    void append(const void* data, size_t size)
+    {
+        if (_used + size > BUFFER_SIZE)
+        {
+            flush();
+            if (size > BUFFER_SIZE)
+            {
+                write_all(static_cast<const char*>(data), size);
+                return;
+            }
+        }
+        memcpy(_buffer + _used, data, size);
+        _used += size;
+    }
+
+    void record(const zmq_msg_t* msg, bool more, bool received)
+    {
+        if (_error != 0)
+            return;
+        // The record has no room for the size of a frame of 4 GiB or more,
+        // and leaving it out would make the rest of the log unreadable.
+        if (zmq_msg_size(msg) > 0xffffffffu)
+        {
+            flush();
+            _error = EMSGSIZE;
+            return;
+        }
+        CaptureRecord header;
+        header.time_ns = monotonic_ns() - _start_ns;
+        header.size = static_cast<uint32_t>(zmq_msg_size(msg));
+        header.flags = (more ? CAPTURE_MORE : 0) | (received ? CAPTURE_RECEIVED : 0);
+        append(&header, sizeof(header));
+        append(zmq_msg_data(const_cast<zmq_msg_t*>(msg)), header.size);
+        ++ frames;
+        bytes += header.size;
+    }
+
+    void flush()
+    {
+        write_all(_buffer, _used);
+        _used = 0;
+    }
+};
+
+//}}}
+
+struct PollerState;
+struct PollerWatch;
+static void poller_socket_touched(PollerWatch* watch);
+static void poller_socket_closed(PollerWatch* watch);
+
+/** Native state of a socket. The Oz extension only holds a pointer to this, so
+the state survives the extension being copied by the garbage collector. */
+struct SocketState
+{
+    /** NULL once a context shutdown has closed the socket ahead of its
+    extension. */
+    void* handle;
+
+    ContextState* context;
+    /** The I/O thread this socket is pinned to, or -1 if it may use all. */
+    int io_thread;
+
+    /** Frames at least this long are compressed. Negative disables the flag
+    byte altogether, which is the default. */
+    int compress_threshold;
+    int compress_level;
+
+    /** Frames at least this long (and not empty) are handed over through
+    shared memory. Negative disables it, which is the default. */
+    int shm_threshold;
+
+    /** The directory to create the overflow spool in. Empty if spooling is
+    disabled. The spool itself is created on the first overflow. */
+    std::string spool_path;
+    int64_t spool_size;
+    Spool* spool;
+
+    /** How long, in microseconds, to spin on ZMQ_EVENTS before parking on
+    ZMQ_FD while waiting to send or receive. Negative keeps the plain retry
+    loop of the Oz side, which is the default. */
+    int busy_poll_us;
+
+    /** Limits the rate of outgoing messages. Disabled by default. */
+    Pacer pacer;
+
+    /** Where frames are recorded, or NULL if the socket is not captured. */
+    CaptureLog* capture;
+
+    SocketStats stats;
+
+    /** The errno of a receive which failed after recvAll or recvConflated
+    had already taken messages: those are returned, and the error is raised by
+    the next call of either. 0 if there is none. */
+    int deferred_error;
+
+    /** The scalable pollers watching this socket. */
+    std::vector<PollerWatch*> watches;
+
+    /** Whether a native thread (a last value cache proxy) owns the socket, so
+    that only that thread may close it. */
+    bool proxied;
+
+    SocketState(void* handle_, ContextState* context_)
+        : handle(handle_), context(context_), io_thread(-1),
+          compress_threshold(-1), compress_level(Z_BEST_SPEED), shm_threshold(-1),
+          spool_size(64 << 20), spool(NULL), busy_poll_us(-1), capture(NULL),
+          deferred_error(0), proxied(false)
+    {
+        memset(&stats, 0, sizeof(stats));
+        context->retain();
+        context->sockets.insert(this);
+    }
+
+    ~SocketState()
+    {
+        release_attachments();
+        if (io_thread >= 0)
+        {
+            -- context->thread_sockets[io_thread];
+            context->thread_bytes[io_thread] -= stats.bytes_sent + stats.bytes_received;
+        }
+        context->sockets.erase(this);
+        context->release();
+    }
+
+    /** Unregister from the pollers, and free the spool and the capture. */
+    void release_attachments()
+    {
+        while (!watches.empty())
+        {
+            PollerWatch* watch = watches.back();
+            watches.pop_back();
+            poller_socket_closed(watch);
+        }
+        delete spool;
+        spool = NULL;
+        delete capture;
+        capture = NULL;
+    }
+
+    /** Close the libzmq socket for a context shutdown, with 'linger' unless it
+    is negative. The state stays registered, and invalid, until its extension
+    is closed or collected. */
+    int shut_down(int linger)
+    {
+        release_attachments();
+        if (linger >= 0)
+            zmq_setsockopt(handle, ZMQ_LINGER, &linger, sizeof(linger));
+        int rc = zmq_close(handle);
+        handle = NULL;
+        return rc;
+    }
+
+    /** Pin the socket to one I/O thread. Only connections made afterwards are
+    affected, so this is done right after the socket is created. */
+    int place(int thread)
+    {
+        uint64_t affinity = 1ULL << thread;
+        if (zmq_setsockopt(handle, ZMQ_AFFINITY, &affinity, sizeof(affinity)) != 0)
+            return -1;
+        io_thread = thread;
+        ++ context->thread_sockets[thread];
+        return 0;
+    }
+
+    /** Called after libzmq calls on the socket, which may swallow the edge
+    of ZMQ_FD that the pollers are waiting for. */
+    void touch()
+    {
+        for (size_t i = 0; i < watches.size(); ++ i)
+            poller_socket_touched(watches[i]);
+    }
+
+    void count_traffic(uint64_t& counter, size_t size)
+    {
+        counter += size;
+        if (io_thread >= 0)
+            context->thread_bytes[io_thread] += size;
+    }
+
+    int* private_option(int name)
+    {
+        switch (name)
+        {
+            case OZZERO_COMPRESS_THRESHOLD: return &compress_threshold;
+            case OZZERO_COMPRESS_LEVEL: return &compress_level;
+            case OZZERO_BUSY_POLL: return &busy_poll_us;
+            case OZZERO_PACE_MESSAGES: return &pacer.msg_rate;
+            case OZZERO_PACE_BYTES: return &pacer.byte_rate;
+            case OZZERO_PACE_BURST: return &pacer.burst_ms;
+            case OZZERO_SHM_THRESHOLD: return &shm_threshold;
+            default: return NULL;
+        }
+    }
+
+    /** Whether the socket is of a publish-subscribe type, where a frame may
+    reach many peers. */
+    bool fans_out() const
+    {
+        int type = -1;
+        size_t length = sizeof(type);
+        zmq_getsockopt(handle, ZMQ_TYPE, &type, &length);
+    #if ZMQ_VERSION >= 30100
+        if (type == ZMQ_XPUB || type == ZMQ_XSUB)
+            return true;
+    #endif
+        return type == ZMQ_PUB || type == ZMQ_SUB;
+    }
+
+    /** Forget the current spool so that the next overflow creates a new one
+    with the new settings. Fails if it still holds frames. */
+    int reset_spool()
+    {
+        if (spool != NULL && !spool->empty())
+        {
+            errno = EINVAL;
+            return -1;
+        }
+        delete spool;
+        spool = NULL;
+        return 0;
+    }
+
+    int set_option(int name, const void* value, size_t length)
+    {
+        switch (name)
+        {
+            case OZZERO_SPOOL_PATH:
+                if (reset_spool() < 0)
+                    return -1;
+                spool_path.assign(static_cast<const char*>(value), length);
+                return 0;
+
+            case OZZERO_SPOOL_SIZE:
+                if (length != sizeof(int64_t) || reset_spool() < 0)
+                    break;
+                spool_size = *static_cast<const int64_t*>(value);
+                return 0;
+
+            case OZZERO_SHM_THRESHOLD:
+                // The receiver unlinks a segment as soon as it maps it, so
+                // every frame must have exactly one receiver.
+                if (length != sizeof(int) || (*static_cast<const int*>(value) >= 0 && fans_out()))
+                    break;
+                shm_threshold = *static_cast<const int*>(value);
+                return 0;
+
+            default:
+                int* option = private_option(name);
+                if (option == NULL || length != sizeof(int))
+                    break;
+                *option = *static_cast<const int*>(value);
+                if (name >= OZZERO_PACE_MESSAGES && name <= OZZERO_PACE_BURST)
+                    pacer.reset();
+                return 0;
+        }
+
+        errno = EINVAL;
+        return -1;
+    }
+
+    int get_option(int name, void* value, size_t* length)
+    {
+        switch (name)
+        {
+            case OZZERO_SPOOL_PATH:
+                *length = std::min(*length, spool_path.size());
+                memcpy(value, spool_path.data(), *length);
+                return 0;
+
+            case OZZERO_SPOOL_SIZE:
+                if (*length < sizeof(int64_t))
+                    break;
+                *static_cast<int64_t*>(value) = spool_size;
+                *length = sizeof(int64_t);
+                return 0;
+
+            default:
+                int* option = private_option(name);
+                if (option == NULL || *length < sizeof(int))
+                    break;
+                *static_cast<int*>(value) = *option;
+                *length = sizeof(int);
+                return 0;
+        }
+
+        errno = EINVAL;
+        return -1;
+    }
+};
+
+int g_id_Socket;
+class Socket : public Extension<Socket, SocketState*, g_id_Socket>
+{
+public:
+    explicit Socket(SocketState* obj) : Extension(obj) {}
+
+    int close() {
+        SocketState* state = _obj;
+        if (state == NULL)
+            return 0;
+        _obj = NULL;
+        void* handle = state->handle;
+        delete state;
+        return handle == NULL ? 0 : zmq_close(handle);
+    }
+
+    virtual OZ_Term printV(int depth)
+    {
+        return OZ_mkTupleC("#", 3,
+                           OZ_atom("<Z14.Socket "),
+                           OZ_unsignedLong(reinterpret_cast<uintptr_t>(_obj ? _obj->handle : NULL)),
+                           OZ_atom(">"));
+    }
+
+    bool is_valid() const { return _obj != NULL && _obj->handle != NULL; }
+    void* handle() const { return _obj->handle; }
+    SocketState& state() { return *_obj; }
+
+    int setsockopt(int name, const void* value, size_t length)
+    {
+        int rc;
+        if (name < OZZERO_OPT_BASE)
+            TRACED(TRACE_SETSOCKOPT, _obj->handle, rc,
+                   zmq_setsockopt(_obj->handle, name, value, length));
+        else
+            rc = _obj->set_option(name, value, length);
+        return rc;
+    }
+
+    int getsockopt(int name, void* value, size_t* length)
+    {
+        int rc;
+        if (name < OZZERO_OPT_BASE)
+        {
+            TRACED(TRACE_GETSOCKOPT, _obj->handle, rc,
+                   zmq_getsockopt(_obj->handle, name, value, length));
+            _obj->touch();
+        }
+        else
+            rc = _obj->get_option(name, value, length);
+        return rc;
+    }
+
+    int bind(const char* addr)
+    {
+        int rc;
+        TRACED(TRACE_BIND, _obj->handle, rc, zmq_bind(_obj->handle, addr));
+        return rc;
+    }
+
+    int connect(const char* addr)
+    {
+        int rc;
+        TRACED(TRACE_CONNECT, _obj->handle, rc, zmq_connect(_obj->handle, addr));
+        return rc;
+    }
+
+    int unbind(const char* addr)
+    {
+    #if ZMQ_VERSION >= 30101
+        int rc;
+        TRACED(TRACE_UNBIND, _obj->handle, rc, zmq_unbind(_obj->handle, addr));
+        return rc;
+    #else
+        RETURN_WRONG_VERSION(zmq_unbind, "3.1.1");
+    #endif
+    }
+
+    int disconnect(const char* addr)
+    {
+    #if ZMQ_VERSION >= 30101
+        int rc;
+        TRACED(TRACE_DISCONNECT, _obj->handle, rc, zmq_disconnect(_obj->handle, addr));
+        return rc;
+    #else
+        RETURN_WRONG_VERSION(zmq_disconnect, "3.1.1");
+    #endif
+    }
+
+    /** The current ZMQ_POLLIN/ZMQ_POLLOUT state of the socket. */
+    int events()
+    {
+    #if ZMQ_VERSION >= 30100
+        int events = 0;
+    #else
+        uint32_t events = 0;
+    #endif
+        size_t length = sizeof(events);
+        int rc = zmq_getsockopt(_obj->handle, ZMQ_EVENTS, &events, &length);
+        _obj->touch();
+        return rc != 0 ? -1 : static_cast<int>(events);
+    }
+
+    /** Whether the last frame received is followed by more parts. */
+    bool has_more()
+    {
+    #if ZMQ_VERSION >= 30100
+        int more = 0;
+    #else
+        int64_t more = 0;
+    #endif
+        size_t length = sizeof(more);
+        zmq_getsockopt(_obj->handle, ZMQ_RCVMORE, &more, &length);
+        return more != 0;
+    }
+
+    /** The largest frame the socket accepts, from ZMQ_MAXMSGSIZE. */
+    uint64_t max_message_size()
+    {
+        int64_t max_size = -1;
+    #ifdef ZMQ_MAXMSGSIZE
+        size_t length = sizeof(max_size);
+        zmq_getsockopt(_obj->handle, ZMQ_MAXMSGSIZE, &max_size, &length);
+    #endif
+        return max_size < 0 ? ~static_cast<uint64_t>(0) : static_cast<uint64_t>(max_size);
+    }
+
+    /** Whether frames on the wire start with a flag byte. */
+    bool is_framed() const
+    {
+        return _obj->compress_threshold >= 0 || _obj->shm_threshold >= 0;
+    }
+
+    /** Turn an application frame into what goes on the wire. */
+    int encode(zmq_msg_t* msg)
+    {
+        if (!is_framed())
+            return 0;
+
+        size_t size = zmq_msg_size(msg);
+        if (_obj->shm_threshold >= 0 && size > 0 && size >= static_cast<size_t>(_obj->shm_threshold))
+            return encode_shm_frame(msg, _obj->stats);
+
+        int threshold = _obj->compress_threshold < 0 ? INT_MAX : _obj->compress_threshold;
+        return encode_frame(msg, threshold, _obj->compress_level, _obj->stats);
+    }
+
+    /** Turn a frame from the wire back into the application frame. */
+    int decode(zmq_msg_t* msg)
+    {
+        if (!is_framed())
+            return 0;
+        return decode_frame(msg, max_message_size(), _obj->shm_threshold >= 0, _obj->stats);
+    }
+
+    /** Send an already encoded frame directly to libzmq. */
+    int send_now(zmq_msg_t* msg, int flags)
+    {
+        size_t size = zmq_msg_size(msg);
+        int rc;
+
+        // libzmq owns the content once it is sent, and may already have
+        // freed it on return, so the capture records a shared copy.
+        zmq_msg_t captured;
+        bool capturing = _obj->capture != NULL && zmq_msg_init(&captured) == 0;
+        if (capturing && zmq_msg_copy(&captured, msg) != 0)
+        {
+            zmq_msg_close(&captured);
+            capturing = false;
+        }
+
+    #if ZMQ_VERSION >= 30101
+        TRACED(TRACE_SEND, _obj->handle, rc, zmq_msg_send(msg, _obj->handle, flags));
+    #elif ZMQ_VERSION >= 30100
+        TRACED(TRACE_SEND, _obj->handle, rc, zmq_sendmsg(_obj->handle, msg, flags));
+    #else
+        TRACED(TRACE_SEND, _obj->handle, rc, zmq_send(_obj->handle, msg, flags));
+    #endif
+        _obj->touch();
+        if (rc >= 0)
+        {
+            ++ _obj->stats.frames_sent;
+            _obj->count_traffic(_obj->stats.bytes_sent, size);
+        }
+        if (capturing)
+        {
+            int error_number = errno;
+            if (rc >= 0)
+                _obj->capture->record(&captured, (flags & ZMQ_SNDMORE) != 0, false);
+            zmq_msg_close(&captured);
+            errno = error_number;
+        }
+        return rc;
+    }
+
+    /** Send an already encoded frame, waiting for the pacer if the socket has
+    rate limits. A nonblocking send fails with EAGAIN instead of waiting; the
+    'busyPoll' builtin then tells the caller how long to wait. */
+    int send_raw(zmq_msg_t* msg, int flags)
+    {
+        Pacer& pacer = _obj->pacer;
+        if (!pacer.enabled())
+            return send_spooled(msg, flags);
+
+        for (;;)
+        {
+            uint64_t delay = pacer.delay();
+            pacer.record(delay, _obj->stats);
+            if (delay == 0)
+                break;
+            if (flags & OZZERO_DONTWAIT)
+            {
+                errno = EAGAIN;
+                return -1;
+            }
+            // A blocking send blocks the emulator anyway, as in zmq_msg_send.
+            timespec wait;
+            wait.tv_sec = delay / 1000000000ULL;
+            wait.tv_nsec = delay % 1000000000ULL;
+            if (nanosleep(&wait, NULL) != 0)
+                return -1;
+        }
+
+        size_t size = zmq_msg_size(msg);
+        int rc = send_spooled(msg, flags);
+        if (rc >= 0)
+            pacer.consume(size, (flags & ZMQ_SNDMORE) != 0);
+        return rc;
+    }
+
+    /** Send an already encoded frame, going through the spool if the socket
+    has one. Like zmq_msg_send, 'msg' is emptied when the frame is accepted. */
+    int send_spooled(zmq_msg_t* msg, int flags)
+    {
+        if (_obj->spool_path.empty())
+            return send_now(msg, flags);
+
+        // Frames must leave in order, so nothing bypasses a nonempty spool.
+        if (drain_spool() < 0)
+            return -1;
+        if (_obj->spool == NULL || _obj->spool->empty())
+        {
+            int rc = send_now(msg, flags);
+            if (rc >= 0 || errno != EAGAIN || !(flags & OZZERO_DONTWAIT))
+                return rc;
+        }
+
+        if (_obj->spool == NULL)
+        {
+            _obj->spool = Spool::create(_obj->spool_path, _obj->spool_size);
+            if (_obj->spool == NULL)
+                return -1;
+        }
+
+        size_t size = zmq_msg_size(msg);
+        if (!_obj->spool->push(zmq_msg_data(msg), size, (flags & ZMQ_SNDMORE) != 0))
+        {
+            ++ _obj->stats.spool_rejected;
+            errno = EAGAIN;
+            return -1;
+        }
+
+        ++ _obj->stats.spooled_frames;
+        zmq_msg_close(msg);
+        zmq_msg_init(msg);
+        return static_cast<int>(size);
+    }
+
+    /** Send as many spooled frames as libzmq accepts without blocking. Returns
+    the number of frames still spooled, or -1 on errors. */
+    int drain_spool()
+    {
+        Spool* spool = _obj->spool;
+        if (spool == NULL)
+            return 0;
+
+        while (!spool->empty())
+        {
+            const char* data;
+            size_t size;
+            bool more;
+            spool->front(data, size, more);
+
+            zmq_msg_t msg;
+            if (zmq_msg_init_size(&msg, size) != 0)
+                return -1;
+            memcpy(zmq_msg_data(&msg), data, size);
+
+            int rc = send_now(&msg, OZZERO_DONTWAIT | (more ? ZMQ_SNDMORE : 0));
+            int error_number = errno;
+            zmq_msg_close(&msg);
+            if (rc < 0)
+            {
+                if (error_number == EAGAIN)
+                    break;
+                errno = error_number;
+                return -1;
+            }
+
+            spool->pop();
+            ++ _obj->stats.drained_frames;
+        }
+        return static_cast<int>(spool->count());
+    }
+
+    /** Receive a frame without decoding it. */
+    int recv_raw(zmq_msg_t* msg, int flags)
+    {
+        int rc;
+    #if ZMQ_VERSION >= 30101
+        TRACED(TRACE_RECV, _obj->handle, rc, zmq_msg_recv(msg, _obj->handle, flags));
+    #elif ZMQ_VERSION >= 30100
+        TRACED(TRACE_RECV, _obj->handle, rc, zmq_recvmsg(_obj->handle, msg, flags));
+    #else
+        TRACED(TRACE_RECV, _obj->handle, rc, zmq_recv(_obj->handle, msg, flags));
+    #endif
+        _obj->touch();
+        if (rc >= 0)
+        {
+            ++ _obj->stats.frames_received;
+            _obj->count_traffic(_obj->stats.bytes_received, zmq_msg_size(msg));
+            if (_obj->capture != NULL)
+                _obj->capture->record(msg, has_more(), true);
+        }
+        return rc;
+    }
+};
+
+/** {ZN.socket +Context +TypeA +Placement ?Socket}
+
+'Placement' chooses the I/O thread the socket is pinned to. It is one of 'none'
+(use all threads, as ZeroMQ does by default), 'roundRobin', 'leastLoaded' (the
+thread with the fewest bytes sent and received by its open sockets) or
+'group(G)' (the same thread as the other sockets of group G).
+*/
+OZ_BI_define(ozzero_socket, 3, 1)
+{
+    OZ_declare(Context, 0, context);
+    ENSURE_VALID(Context, context);
+    OZ_declareAndDecode(g_atom_decoder.socket_type_map, "socket type", 1, type);
+    OZ_declareDetTerm(2, placement_term);
+
+    ContextState& state = context->state();
+    int thread;
+    if (OZ_isAtom(placement_term))
+    {
+        const char* placement = OZ_atomToC(placement_term);
+        if (strcmp(placement, "none") == 0)
+            thread = -1;
+        else if (strcmp(placement, "roundRobin") == 0)
+            thread = state.round_robin_thread();
+        else if (strcmp(placement, "leastLoaded") == 0)
+            thread = state.least_loaded_thread();
+        else
+            return OZ_typeError(2, "socket placement");
+    }
+    else if (OZ_isTuple(placement_term) && OZ_width(placement_term) == 1
+            && strcmp(OZ_atomToC(OZ_label(placement_term)), "group") == 0)
+    {
+        OZ_Term group_term = OZ_getArg(placement_term, 0);
+        int group_length;
+        if (!OZ_isVirtualString(group_term, NULL))
+            return OZ_typeError(2, "socket placement");
+        const char* group = OZ_virtualStringToC(group_term, &group_length);
+        thread = state.group_thread(std::string(group, group_length));
+    }
+    else
+    {
+        return OZ_typeError(2, "socket placement");
+    }
+
+    void* socket = context->socket(type);
+    if (socket == NULL)
+        return raise_error();
+
+    SocketState* socket_state = new SocketState(socket, &state);
+    if (thread >= 0 && socket_state->place(thread) != 0)
+    {
+        int error_number = errno;
+        zmq_close(socket);
+        delete socket_state;
+        errno = error_number;
+        return raise_error();
+    }
+    OZ_RETURN(OZ_extension(new Socket(socket_state)));
+}
+OZ_BI_end
+
+/** {ZN.close +Socket} */
+OZ_BI_define(ozzero_close, 1, 0)
+{
+    OZ_declare(Socket, 0, socket);
+    int rc = socket->close();
+    collect_term_slots();
+    return checked(rc);
+}
+OZ_BI_end
+
+/** {ZN.setsockopt +Socket +OptA +TypeA +Term}
+
+where TypeA should be one of 'int', 'int64', 'uint64' or other things (which
+will be interpreted as 'byteString').
+*/
+OZ_BI_define(ozzero_setsockopt, 4, 1)
+{
+    OZ_declare(Socket, 0, socket);
+    ENSURE_VALID(Socket, socket);
+    OZ_declareAndDecode(g_atom_decoder.sockopt_map, "socket option", 1, real_name);
+    OZ_declareDetTerm(2, type_term);
+    return set_opt_common(2, type_term, real_name, OZ_in(3), OZ_out(0),
+                          socket, &Socket::setsockopt);
+}
+OZ_BI_end
+
+/** {ZN.getsockopt +Socket +OptA +TypeA ?Term}
+
+where TypeA should be one of 'int', 'int64', 'uint64' or an integer (which will
+be interpreted as a 'byteString' with a maximum length).
+*/
+OZ_BI_define(ozzero_getsockopt, 3, 1)
+{
+    OZ_declare(Socket, 0, socket);
+    ENSURE_VALID(Socket, socket);
+    OZ_declareAndDecode(g_atom_decoder.sockopt_map, "socket option", 1, real_name);
+    OZ_declareDetTerm(2, type_term);
+    return get_opt_common(2, type_term, real_name, OZ_out(0),
+                          socket, &Socket::getsockopt);
+}
+OZ_BI_end
+
+/** {ZN.bind +Socket +AddrVS}
+    {ZN.connect +Socket +AddrVS}
+    {ZN.unbind +Socket +AddrVS}
+    {ZN.disconnect +Socket +AddrVS}
+*/
+#define DEFINE_CONNECT_FUNC(NAME) \
+    OZ_BI_define(ozzero_##NAME, 2, 0) \
+    { \
+        OZ_declare(Socket, 0, socket); \
+        ENSURE_VALID(Socket, socket); \
+        OZ_declareVirtualString(1, addr); \
+        return checked(socket->NAME(addr)); \
+    } \
+    OZ_BI_end
+
+DEFINE_CONNECT_FUNC(bind)
+DEFINE_CONNECT_FUNC(connect)
+DEFINE_CONNECT_FUNC(unbind)
+DEFINE_CONNECT_FUNC(disconnect)
+
+#undef DEFINE_CONNECT_FUNC
+
+/** {ZN.socketStats +Socket ?StatsR} */
+OZ_BI_define(ozzero_socket_stats, 1, 1)
+{
+    OZ_declare(Socket, 0, socket);
+    ENSURE_VALID(Socket, socket);
+    const SocketStats& stats = socket->state().stats;
+    const Spool* spool = socket->state().spool;
+
+    double compress_ratio = stats.compress_bytes_in == 0 ? 1.0 :
+        static_cast<double>(stats.compress_bytes_out) / stats.compress_bytes_in;
+
+    OZ_Term props[] = {
+        OZ_pairA("framesSent", OZ_uint64(stats.frames_sent)),
+        OZ_pairA("framesReceived", OZ_uint64(stats.frames_received)),
+        OZ_pairA("bytesSent", OZ_uint64(stats.bytes_sent)),
+        OZ_pairA("bytesReceived", OZ_uint64(stats.bytes_received)),
+        OZ_pairA("compressedFrames", OZ_uint64(stats.compressed_frames)),
+        OZ_pairA("compressRatio", OZ_float(compress_ratio)),
+        OZ_pairA("compressMicros", OZ_uint64(stats.compress_ns / 1000)),
+        OZ_pairA("decompressedFrames", OZ_uint64(stats.decompressed_frames)),
+        OZ_pairA("decompressMicros", OZ_uint64(stats.decompress_ns / 1000)),
+        OZ_pairA("spooledFrames", OZ_uint64(stats.spooled_frames)),
+        OZ_pairA("drainedFrames", OZ_uint64(stats.drained_frames)),
+        OZ_pairA("spoolRejected", OZ_uint64(stats.spool_rejected)),
+        OZ_pairA("spoolBytes", OZ_uint64(spool ? spool->used() : 0)),
+        OZ_pairA("conflatedMessages", OZ_uint64(stats.conflated_messages)),
+        OZ_pairA("throttledSends", OZ_uint64(stats.throttled_sends)),
+        OZ_pairA("throttledMicros", OZ_uint64(stats.throttled_ns / 1000)),
+        OZ_pairA("shmFramesSent", OZ_uint64(stats.shm_frames_sent)),
+        OZ_pairA("shmBytesSent", OZ_uint64(stats.shm_bytes_sent)),
+        OZ_pairA("shmFramesReceived", OZ_uint64(stats.shm_frames_received)),
+    };
+    OZ_Term prop_list = OZ_toList(sizeof(props)/sizeof(*props), props);
+    OZ_RETURN(OZ_recordInitC("stats", prop_list));
+}
+OZ_BI_end
+
+/** {ZN.spoolDrain +Socket ?RemainingI} */
+OZ_BI_define(ozzero_spool_drain, 1, 1)
+{
+    OZ_declare(Socket, 0, socket);
+    ENSURE_VALID(Socket, socket);
+    int remaining = socket->drain_spool();
+    if (remaining < 0)
+        return raise_error();
+    OZ_RETURN_INT(remaining);
+}
+OZ_BI_end
+
+static inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause");
+#endif
+}
+
+/** {ZN.busyPoll +Socket +EventsL ?ResultA}
+
+Wait for one of 'EventsL' ('pollin', 'pollout') following the busy poll policy
+of the socket. Returns 'ready' once ZMQ_EVENTS has it, or 'park' when the time
+allowed by the 'busyPoll' option has run out. The caller should then wait for
+ZMQ_FD to be readable and check again, which is safe since ZMQ_EVENTS was read
+last. Returns 'retry' at once if the option is negative.
+
+When 'pollout' is wanted and the rate limits of the socket hold the next
+message back, returns 'pace(FdI)' instead, where 'FdI' becomes readable once
+the message may be sent, or 'delay(MsI)' on platforms without timerfd.
+*/
+OZ_BI_define(ozzero_busy_poll, 2, 1)
+{
+    OZ_declare(Socket, 0, socket);
+    ENSURE_VALID(Socket, socket);
+    OZ_declareDetTerm(1, events_term);
+    short wanted;
+    PARSE_FLAGS(g_atom_decoder.poll_events_map, "'pollin' or 'pollout'",
+                1, events_term, wanted);
+
+    if (wanted & ZMQ_POLLOUT)
+    {
+        uint64_t delay = socket->state().pacer.delay();
+        if (delay > 0)
+        {
+            int fd = socket->state().pacer.arm(delay);
+            if (fd >= 0)
+                OZ_RETURN(OZ_mkTupleC("pace", 1, OZ_int(fd)));
+            OZ_RETURN(OZ_mkTupleC("delay", 1, OZ_int(static_cast<int>(delay / 1000000 + 1))));
+        }
+    }
+
+    int busy_poll_us = socket->state().busy_poll_us;
+    if (busy_poll_us < 0)
+        OZ_RETURN(OZ_atom("retry"));
+
+    uint64_t deadline = monotonic_ns() + static_cast<uint64_t>(busy_poll_us) * 1000;
+    for (;;)
+    {
+        int events = socket->events();
+        if (events < 0)
+            return raise_error();
+        if (events & wanted)
+            OZ_RETURN(OZ_atom("ready"));
+        if (monotonic_ns() >= deadline)
+            OZ_RETURN(OZ_atom("park"));
+        cpu_relax();
+    }
+}
+OZ_BI_end
+
+//}}}
+//------------------------------------------------------------------------------
+//{{{ Message
+
+int g_id_Message;
+class Message : public ExtensionBase<Message, zmq_msg_t, g_id_Message>
+{
+private:
+    bool _closed;
+
+    /** Whether the content has been encoded for sending already. */
+    bool _encoded;
+
+    /** The size of the content as counted in g_off_heap, -1 if not counted. */
+    int64_t _accounted;
+
+    /** Bring g_off_heap up to date after the content has changed. */
+    int account(int rc = 0)
+    {
+        int error_number = errno;
+        int64_t current = _closed ? -1 : static_cast<int64_t>(zmq_msg_size(&_obj));
+        if (current != _accounted)
+        {
+            g_off_heap.messages += (current >= 0) - (_accounted >= 0);
+            g_off_heap.charge(g_off_heap.message_bytes,
+                              std::max<int64_t>(current, 0) - std::max<int64_t>(_accounted, 0));
+            _accounted = current;
+        }
+        errno = error_number;
+        return rc;
+    }
+
+    Message(zmq_msg_t* src, bool by_copy, bool encoded)
+        : _closed(false), _encoded(encoded), _accounted(-1)
+    {
+        zmq_msg_init(&_obj);
+        int rc = by_copy ? zmq_msg_copy(&_obj, src) : zmq_msg_move(&_obj, src);
+        account();
+        if (rc == 0)
+            return;
+        char errstr[48];
+        snprintf(errstr, sizeof(errstr), "Fail to copy message (Error #%d)", errno);
+        Assert(buffer);
+    }
+
+public:
+    virtual OZ_Extension* gCollectV()
+    {
+        // Hand the accounted bytes over without counting them twice.
+        _closed = true;
+        account();
+        return new Message(&_obj, /*by_copy*/false, _encoded);
+    }
+    virtual OZ_Extension* sCloneV() { return new Message(&_obj, /*by_copy*/true, _encoded); }
+    // ^ should we allow this? Or do an Assert(0)?
+
+    Message() : _closed(true), _encoded(false), _accounted(-1) {}
+
+    ~Message() { close(); }
+
+    int close()
+    {
+        if (_closed)
+            return 0;
+        _closed = true;
+        return account(zmq_msg_close(&_obj));
+    }
+
+    bool is_valid() const { return !_closed; }
+
+    int init()
+    {
+        int rc = zmq_msg_init(&_obj);
+        _closed = (rc != 0);
+        _encoded = false;
+        return account(rc);
+    }
+
+    int init_size(size_t size)
+    {
+        int rc = zmq_msg_init_size(&_obj, size);
+        _closed = (rc != 0);
+        _encoded = false;
+        return account(rc);
+    }
+
+    int init_data(void* data, size_t size, zmq_free_fn* free_fn, void* hint)
+    {
+        int rc = zmq_msg_init_data(&_obj, data, size, free_fn, hint);
+        _closed = (rc != 0);
+        _encoded = false;
+        return account(rc);
+    }
+
+    size_t size() { return zmq_msg_size(&_obj); }
+    void* data() { return zmq_msg_data(&_obj); }
+    int copy(Message& other)
+    {
+        _encoded = other._encoded;
+        return account(zmq_msg_copy(&_obj, &other._obj));
+    }
+
+    /** Make 'dest', an initialised zmq_msg_t, share the content. */
+    int copy_to(zmq_msg_t* dest)
+    {
+        return zmq_msg_copy(dest, &_obj);
+    }
+
+    int move(Message& other)
+    {
+        _encoded = other._encoded;
+        int rc = zmq_msg_move(&_obj, &other._obj);
+        other.account();
+        return account(rc);
+    }
+
+    void set_data(const void* new_data, size_t new_size)
+    {
+        void* old_data = zmq_msg_data(&_obj);
+        memcpy(old_data, new_data, new_size);
+    }
+
+    int get(int name)
+    {
+    #if ZMQ_VERSION >= 30101
+        return zmq_msg_get(&_obj, name);
+    #elif ZMQ_VERSION >= 30100
+        int retval;
+        size_t length = sizeof(retval);
+        int errcode = zmq_getmsgopt(&_obj, name, &retval, &length);
+        return errcode < 0 ? errcode : retval;
+    #else
+        RETURN_WRONG_VERSION(zmq_msg_get, "3.1.0");
+    #endif
+    }
+
+    int set(int name, int value)
+    {
+    #if ZMQ_VERSION >= 30101
+        return zmq_msg_set(&_obj, name, value);
+    #else
+        RETURN_WRONG_VERSION(zmq_msg_set, "3.1.1");
+    #endif
+    }
+
+    int recv(Socket& socket, int flags)
+    {
+        int rc = socket.recv_raw(&_obj, flags);
+        if (rc >= 0 && socket.decode(&_obj) < 0)
+            rc = -1;
+        _encoded = false;
+        return account(rc);
+    }
+
+    int send(Socket& socket, int flags)
+    {
+        // A send interrupted by EAGAIN is retried with the same message, which
+        // must not be encoded a second time.
+        if (!_encoded)
+        {
+            if (socket.encode(&_obj) < 0)
+                return account(-1);
+            _encoded = true;
+        }
+        return account(socket.send_raw(&_obj, flags));
+    }
+
+    virtual OZ_Term printV(int depth)
+    {
+        return OZ_mkTupleC("#", 3,
+                           OZ_atom("<Z14.Message "),
+                           OZ_mkByteString(static_cast<char*>(data()), size()),
+                           OZ_atom(">"));
+    }
+};
+
+/** {ZN.msgInit +Message} */
+OZ_BI_define(ozzero_msg_init, 1, 0)
+{
+    OZ_declare(Message, 0, msg);
+    return checked(msg->init());
+}
+OZ_BI_end
+
+/** {ZN.msgInitSize +Size +Message} */
+OZ_BI_define(ozzero_msg_init_size, 2, 0)
+{
+    OZ_declare(Message, 0, msg);
+    OZ_declareLong(1, size);
+    if (size < 0)
+        return OZ_typeError(0, "nonnegative integer");
+    return checked(msg->init_size(static_cast<size_t>(size)));
+}
+OZ_BI_end
+
+/** {ZN.msgCreate ?Message} */
+OZ_BI_define(ozzero_msg_create, 0, 1)
+{
+    OZ_RETURN(OZ_extension(new Message()));
+}
+OZ_BI_end
+
+/** {ZN.msgClose +Message} */
+OZ_BI_define(ozzero_msg_close, 1, 0)
+{
+    OZ_declare(Message, 0, msg);
+    return checked(msg->close());
+}
+OZ_BI_end
+
+/** {ZN.msgSize +Message ?Size} */
+OZ_BI_define(ozzero_msg_size, 1, 1)
+{
+    OZ_declare(Message, 0, msg);
+    ENSURE_VALID(Message, msg);
+    OZ_RETURN_INT(msg->size());
+}
+OZ_BI_end
+
+/** {ZN.msgData +Message ?DataByteString} */
+OZ_BI_define(ozzero_msg_data, 1, 1)
+{
+    OZ_declare(Message, 0, msg);
+    ENSURE_VALID(Message, msg);
+    const char* data = static_cast<const char*>(msg->data());
+    OZ_RETURN(OZ_mkByteString(data, msg->size()));
+}
+OZ_BI_end
+
+/** {ZN.msgMove +DestMessage +SrcMessage} */
+OZ_BI_define(ozzero_msg_move, 2, 0)
+{
+    OZ_declare(Message, 0, dest);
+    ENSURE_VALID(Message, dest);
+    OZ_declare(Message, 1, src);
+    ENSURE_VALID(Message, src);
+    return checked(dest->move(*src));
+}
+OZ_BI_end
+
+/** {ZN.msgCopy +DestMessage +SrcMessage} */
+OZ_BI_define(ozzero_msg_copy, 2, 0)
+{
+    OZ_declare(Message, 0, dest);
+    ENSURE_VALID(Message, dest);
+    OZ_declare(Message, 1, src);
+    ENSURE_VALID(Message, src);
+    return checked(dest->copy(*src));
+}
+OZ_BI_end
+
+/** {ZN.msgSetData +Message +ByteString} */
+OZ_BI_define(ozzero_msg_set_data, 2, 0)
+{
+    OZ_declare(Message, 0, msg);
+    OZ_declareByteString(1, data);
+    ENSURE_VALID(Message, msg);
+    size_t size = data->getSize();
+    size_t required_size = msg->size();
+    if (size == required_size)
+    {
+        msg->set_data(data->getData(), size);
+        return OZ_ENTAILED;
+    }
+
+    char buffer[100];
+    snprintf(buffer, sizeof(buffer),
+             "Invalid data size: requiring %zu, but %zu is provided",
+             required_size, size);
+    return OZ_raiseErrorC("zmqError", 2, OZ_atom("invalidDataSize"), OZ_string(buffer));
+}
+OZ_BI_end
+
+/** {ZN.msgGet +Message +OptA ?RetI} */
+OZ_BI_define(ozzero_msg_get, 2, 1)
+{
+    OZ_declare(Message, 0, msg);
+    ENSURE_VALID(Message, msg);
+    OZ_declareAndDecode(g_atom_decoder.msg_getset_map, "message option", 1, option);
+
+    int res = msg->get(option);
+    if (res < 0)
+        return raise_error();
+    else
+        return res;
+}
+OZ_BI_end
+
+/** {ZN.msgSet +Message +OptA +ValueI} */
+OZ_BI_define(ozzero_msg_set, 3, 0)
+{
+    OZ_declare(Message, 0, msg);
+    ENSURE_VALID(Message, msg);
+    OZ_declareAndDecode(g_atom_decoder.msg_getset_map, "message option", 1, option);
+    OZ_declareInt(2, value);
+
+    return checked(msg->set(option, value));
+}
+OZ_BI_end
+
+
+/** {ZN.msgCreateWithData +ByteString ?Message} */
+OZ_BI_define(ozzero_msg_create_with_data, 1, 1)
+{
+    OZ_declareByteString(0, data);
+    Message* msg = new Message();
+    size_t size = data->getSize();
+    msg->init_size(size);
+    msg->set_data(data->getData(), size);
+    OZ_RETURN(OZ_extension(msg));
+}
+OZ_BI_end
+
+/** Flattens a virtual string straight into a frame. The first pass measures
+every piece, formatting numbers into a scratch buffer on the way, and the
+second one writes the pieces into the frame. Nothing is allocated on the Oz
+heap. */
+class VirtualStringGather
+{
+    enum Kind { BYTES, SCRATCH, CHARS };
+
+    struct Piece
+    {
+        Kind kind;
+        /** The data for BYTES, the offset into the scratch buffer for SCRATCH,
+        and the list for CHARS. */
+        const char* data;
+        size_t offset;
+        OZ_Term list;
+        size_t size;
+    };
+
+    std::vector<Piece> _pieces;
+    std::string _scratch;
+    size_t _size;
+    OZ_Term _unbound;
+
+    void push(Kind kind, const char* data, size_t offset, OZ_Term list, size_t size)
+    {
+        if (size == 0)
+            return;
+        Piece piece = {kind, data, offset, list, size};
+        _pieces.push_back(piece);
+        _size += size;
+    }
+
+    void push_scratch(const char* text, size_t size)
+    {
+        push(SCRATCH, NULL, _scratch.size(), 0, size);
+        _scratch.append(text, size);
+    }
+
+public:
+    enum Result { OK, UNBOUND, NOT_VS };
+
+    VirtualStringGather() : _size(0), _unbound(0) {}
+
+    size_t size() const { return _size; }
+
+    /** The variable to suspend on after 'add' returned UNBOUND. */
+    OZ_Term unbound() const { return _unbound; }
+
+    Result add(OZ_Term term)
+    {
+        term = OZ_deref(term);
+        if (OZ_isVariable(term))
+        {
+            _unbound = term;
+            return UNBOUND;
+        }
+
+        if (OZ_isNil(term))
+            return OK;
+
+        if (OZ_isAtom(term))
+        {
+            const char* name = OZ_atomToC(term);
+            if (strcmp(name, "#") != 0)
+                push(BYTES, name, 0, 0, strlen(name));
+            return OK;
+        }
+
+        if (OZ_isSmallInt(term))
+        {
+            char buffer[32];
+            long value = OZ_intToCL(term);
+            int length = snprintf(buffer, sizeof(buffer), "%ld", value);
+            if (value < 0)
+                buffer[0] = '~';
+            push_scratch(buffer, length);
+            return OK;
+        }
+
+        if (OZ_isInt(term) || OZ_isFloat(term))
+        {
+            // Let Mozart do the big integers and the float syntax.
+            int length;
+            const char* text = OZ_virtualStringToC(term, &length);
+            push_scratch(text, length);
+            return OK;
+        }
+
+        if (OZ_isByteString(term))
+        {
+            ByteString* bs = tagged2ByteString(term);
+            push(BYTES, reinterpret_cast<const char*>(bs->getData()), 0, 0, bs->getSize());
+            return OK;
+        }
+
+        if (OZ_isCons(term))
+        {
+            size_t length = 0;
+            OZ_Term it = term;
+            for (; OZ_isCons(it); it = OZ_deref(OZ_tail(it)))
+            {
+                OZ_Term c = OZ_deref(OZ_head(it));
+                if (OZ_isVariable(c))
+                {
+                    _unbound = c;
+                    return UNBOUND;
+                }
+                if (!OZ_isSmallInt(c) || static_cast<unsigned long>(OZ_intToCL(c)) > 255)
+                    return NOT_VS;
+                ++ length;
+            }
+            if (OZ_isVariable(it))
+            {
+                _unbound = it;
+                return UNBOUND;
+            }
+            if (!OZ_isNil(it))
+                return NOT_VS;
+            push(CHARS, NULL, 0, term, length);
+            return OK;
+        }
+
+        if (OZ_isTuple(term) && strcmp(OZ_atomToC(OZ_label(term)), "#") == 0)
+        {
+            int width = OZ_width(term);
+            for (int i = 0; i < width; ++ i)
+            {
+                Result result = add(OZ_getArg(term, i));
+                if (result != OK)
+                    return result;
+            }
+            return OK;
+        }
+
+        return NOT_VS;
+    }
+
+    /** Copy everything added into 'buffer', which has room for size() bytes. */
+    void write(char* buffer) const
+    {
+        for (size_t i = 0; i < _pieces.size(); ++ i)
+        {
+            const Piece& piece = _pieces[i];
+            switch (piece.kind)
+            {
+                case BYTES:
+                    memcpy(buffer, piece.data, piece.size);
+                    break;
+                case SCRATCH:
+                    memcpy(buffer, _scratch.data() + piece.offset, piece.size);
+                    break;
+                case CHARS:
+                {
+                    char* out = buffer;
+                    for (OZ_Term it = piece.list; OZ_isCons(it); it = OZ_deref(OZ_tail(it)))
+                        *out++ = static_cast<char>(OZ_intToCL(OZ_deref(OZ_head(it))));
+                    break;
+                }
+            }
+            buffer += piece.size;
+        }
+    }
+};
+
+/** {ZN.msgCreateWithVS +VS ?Message}
+
+Create a message holding a virtual string, written straight into the frame
+without building a byte string first.
+*/
+OZ_BI_define(ozzero_msg_create_with_vs, 1, 1)
+{
+    VirtualStringGather gather;
+    switch (gather.add(OZ_in(0)))
+    {
+        case VirtualStringGather::UNBOUND:
+            return OZ_suspendOnInternal(gather.unbound());
+        case VirtualStringGather::NOT_VS:
+            return OZ_typeError(0, "VirtualString");
+        default:
+            break;
+    }
+
+    Message* msg = new Message();
+    if (msg->init_size(gather.size()) != 0)
+        return raise_error();
+    gather.write(static_cast<char*>(msg->data()));
+    OZ_RETURN(OZ_extension(msg));
+}
+OZ_BI_end
+
+/** {ZN.msgSend +Message +Socket +FlagsL ?Completed ?Interrupted} */
+OZ_BI_define(ozzero_msg_send, 3, 2)
+{
+    OZ_declare(Message, 0, msg);
+    OZ_declare(Socket, 1, socket);
+    OZ_declareDetTerm(2, flags_term);
+    return send_or_recv(socket, msg, flags_term, &Message::send,
+                        OZ_out(0), OZ_out(1));
+}
+OZ_BI_end
+
+/** {ZN.msgRecv +Message +Socket +FlagsL ?Completed ?Interrupted} */
+OZ_BI_define(ozzero_msg_recv, 3, 2)
+{
+    OZ_declare(Message, 0, msg);
+    OZ_declare(Socket, 1, socket);
+    OZ_declareDetTerm(2, flags_term);
+    return send_or_recv(socket, msg, flags_term, &Message::recv,
+                        OZ_out(0), OZ_out(1));
+}
+OZ_BI_end
+
+static OZ_Return send_or_recv(Socket* socket, Message* msg, OZ_Term flags_term,
+                              int (Message::*method)(Socket&, int),
+                              OZ_Term& retval, OZ_Term& interrupted)
+{
+    ENSURE_VALID(Socket, socket);
+    ENSURE_VALID(Message, msg);
+
+    int flags;
+    PARSE_FLAGS(g_atom_decoder.send_recv_flags_map, "send/recv options",
+                2, flags_term, flags);
+
+    return completion((msg->*method)(*socket, flags), retval, interrupted);
+}
+
+/** Turn the result of a send or receive into the 'Completed' and 'Interrupted'
+outputs, raising on errors. */
+static OZ_Return completion(int rc, OZ_Term& retval, OZ_Term& interrupted)
+{
+    interrupted = OZ_false();
+    if (rc >= 0)
+    {
+        retval = OZ_true();
+        return OZ_ENTAILED;
+    }
+    else {
+        int error_number = errno;
+        switch (error_number)
+        {
+            case EAGAIN:
+                retval = OZ_false();
+                return OZ_ENTAILED;
+            case EINTR:
+                if (!am.isSetSFlag(SigPending))
+                {
+                    interrupted = OZ_true();
+                    return OZ_ENTAILED;
+                }
+                // else fallthrough
+            default:
+                return raise_error();
+        }
+    }
+}
+
+/** Receive the next frame of 'socket' into 'msg', which must be initialized.
+The return values are like those of send_or_recv: 1 if a frame arrived, 0 on
+EAGAIN or on an interruption (in which case 'interrupted' is set), and -1 on
+errors. */
+static int recv_frame(Socket& socket, zmq_msg_t* msg, int flags, bool& interrupted)
+{
+    if (socket.recv_raw(msg, flags) >= 0)
+        return socket.decode(msg) < 0 ? -1 : 1;
+    if (errno == EAGAIN)
+        return 0;
+    if (errno == EINTR && !am.isSetSFlag(SigPending))
+    {
+        interrupted = true;
+        return 0;
+    }
+    return -1;
+}
+
+/** Receive and drop what is left of a message after one of its frames has
+failed, so that the next receive starts with a new message. Keeps errno. */
+static void skip_rest_of_message(Socket& socket)
+{
+    int error_number = errno;
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    while (socket.has_more())
+    {
+        int rc;
+        do
+            rc = socket.recv_raw(&msg, 0);
+        while (rc < 0 && errno == EINTR);
+        if (rc < 0)
+            break;
+    }
+    zmq_msg_close(&msg);
+    errno = error_number;
+}
+
+/** Raise the error a previous drain of 'socket' has put off, if any. */
+static bool take_deferred_error(Socket& socket)
+{
+    int& deferred_error = socket.state().deferred_error;
+    if (deferred_error == 0)
+        return false;
+    errno = deferred_error;
+    deferred_error = 0;
+    return true;
+}
+
+/** After a frame has failed: skip the rest of its message, and defer the error
+if messages have been taken already, so that those are not lost. Returns
+whether the caller must raise the error right away. */
+static bool fail_drain(Socket& socket, bool has_messages)
+{
+    skip_rest_of_message(socket);
+    if (!has_messages)
+        return true;
+    socket.state().deferred_error = errno;
+    return false;
+}
+
+/** {ZN.recvAll +Socket +MaxI ?MessagesL ?BytesI ?Interrupted}
+
+Receive every message already queued on the socket, up to 'MaxI' of them (no
+limit if negative), without waiting. Each message is a list of byte strings,
+and 'BytesI' is their total size. When a frame fails, the rest of its message
+is dropped; if messages were received before, they are returned and the error
+is raised by the next call.
+*/
+OZ_BI_define(ozzero_recv_all, 2, 3)
+{
+    OZ_declare(Socket, 0, socket);
+    ENSURE_VALID(Socket, socket);
+    OZ_declareLong(1, max_count);
+    if (take_deferred_error(*socket))
+        return raise_error();
+
+    std::vector<OZ_Term> messages;
+    std::vector<OZ_Term> frames;
+    uint64_t bytes = 0;
+    uint64_t message_bytes = 0;
+    bool interrupted = false;
+
+    zmq_msg_t msg;
+    if (zmq_msg_init(&msg) != 0)
+        return raise_error();
+
+    while (max_count < 0 || static_cast<long>(messages.size()) < max_count)
+    {
+        // The rest of a multipart message is always queued already, so only
+        // the first frame may find nothing.
+        int flags = frames.empty() ? OZZERO_DONTWAIT : 0;
+        int rc = recv_frame(*socket, &msg, flags, interrupted);
+        if (rc < 0)
+        {
+            if (!fail_drain(*socket, !messages.empty()))
+                break;
+            int error_number = errno;
+            zmq_msg_close(&msg);
+            errno = error_number;
+            return raise_error();
+        }
+        if (rc == 0)
+        {
+            // Never stop in the middle of a message.
+            if (frames.empty())
+                break;
+            interrupted = false;
+            continue;
+        }
+
+        size_t size = zmq_msg_size(&msg);
+        message_bytes += size;
+        frames.push_back(OZ_mkByteString(static_cast<const char*>(zmq_msg_data(&msg)), size));
+        if (!socket->has_more())
+        {
+            messages.push_back(OZ_toList(frames.size(), frames.data()));
+            frames.clear();
+            bytes += message_bytes;
+            message_bytes = 0;
+        }
+    }
+    zmq_msg_close(&msg);
+    collect_term_slots();
+
+    OZ_out(0) = OZ_toList(messages.size(), messages.data());
+    OZ_out(1) = OZ_uint64(bytes);
+    OZ_out(2) = interrupted ? OZ_true() : OZ_false();
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+/** The newest message of each topic seen by a conflating receive. Frames are
+moved out of libzmq, so superseded messages are dropped without ever being
+copied into Oz. */
+class ConflationTable
+{
+    typedef std::vector<zmq_msg_t*> Frames;
+
+    /** Messages in the order of their arrival; superseded ones are empty. */
+    std::vector<Frames> _messages;
+    std::tr1::unordered_map<std::string, size_t> _latest;
+    size_t _dropped;
+
+    static void release(Frames& frames)
+    {
+        for (size_t i = 0; i < frames.size(); ++ i)
+        {
+            zmq_msg_close(frames[i]);
+            delete frames[i];
+        }
+        frames.clear();
+    }
+
+public:
+    ConflationTable() : _dropped(0) {}
+
+    ~ConflationTable()
+    {
+        for (size_t i = 0; i < _messages.size(); ++ i)
+            release(_messages[i]);
+    }
+
+    size_t dropped() const { return _dropped; }
+
+    /** Keep 'frames' as the newest message of 'key', taking ownership. */
+    void put(const std::string& key, Frames& frames)
+    {
+        std::pair<std::tr1::unordered_map<std::string, size_t>::iterator, bool> inserted
+            = _latest.insert(std::make_pair(key, _messages.size()));
+        if (!inserted.second)
+        {
+            release(_messages[inserted.first->second]);
+            inserted.first->second = _messages.size();
+            ++ _dropped;
+        }
+        _messages.push_back(Frames());
+        _messages.back().swap(frames);
+    }
+
+    /** The survivors as lists of byte strings, in the order of their arrival. */
+    OZ_Term to_list()
+    {
+        std::vector<OZ_Term> message_terms;
+        std::vector<OZ_Term> frame_terms;
+        for (size_t i = 0; i < _messages.size(); ++ i)
+        {
+            Frames& frames = _messages[i];
+            if (frames.empty())
+                continue;
+            frame_terms.clear();
+            for (size_t j = 0; j < frames.size(); ++ j)
+                frame_terms.push_back(OZ_mkByteString(static_cast<const char*>(zmq_msg_data(frames[j])),
+                                                      zmq_msg_size(frames[j])));
+            message_terms.push_back(OZ_toList(frame_terms.size(), frame_terms.data()));
+        }
+        return OZ_toList(message_terms.size(), message_terms.data());
+    }
+};
+
+/** {ZN.recvConflated +Socket +KeySizeI +DelimiterI +MaxI ?MessagesL ?Interrupted}
+
+Like recvAll, but only keep the newest message of each topic. The topic is the
+start of the first frame, up to the first 'DelimiterI' byte (if not negative)
+and at most 'KeySizeI' bytes (if positive). The survivors are returned in the
+order they arrived in; the others are counted in the 'conflatedMessages'
+statistic of the socket. A failing frame is handled like in recvAll.
+*/
+OZ_BI_define(ozzero_recv_conflated, 4, 2)
+{
+    OZ_declare(Socket, 0, socket);
+    ENSURE_VALID(Socket, socket);
+    OZ_declareLong(1, key_size);
+    OZ_declareInt(2, delimiter);
+    OZ_declareLong(3, max_count);
+    if (take_deferred_error(*socket))
+        return raise_error();
+
+    ConflationTable table;
+    std::vector<zmq_msg_t*> frames;
+    std::string key;
+    long count = 0;
+    bool interrupted = false;
+
+    while (max_count < 0 || count < max_count)
+    {
+        zmq_msg_t* msg = new zmq_msg_t;
+        zmq_msg_init(msg);
+
+        // The rest of a multipart message is always queued already, so only
+        // the first frame may find nothing.
+        int flags = frames.empty() ? OZZERO_DONTWAIT : 0;
+        int rc = recv_frame(*socket, msg, flags, interrupted);
+        if (rc <= 0)
+        {
+            int error_number = errno;
+            zmq_msg_close(msg);
+            delete msg;
+            if (rc < 0)
+            {
+                for (size_t i = 0; i < frames.size(); ++ i)
+                {
+                    zmq_msg_close(frames[i]);
+                    delete frames[i];
+                }
+                errno = error_number;
+                if (!fail_drain(*socket, count > 0))
+                    break;
+                return raise_error();
+            }
+            // Never stop in the middle of a message.
+            if (frames.empty())
+                break;
+            interrupted = false;
+            continue;
+        }
+
+        if (frames.empty())
+        {
+            const char* data = static_cast<const char*>(zmq_msg_data(msg));
+            size_t size = zmq_msg_size(msg);
+            if (delimiter >= 0)
+            {
+                const void* found = memchr(data, delimiter, size);
+                if (found != NULL)
+                    size = static_cast<const char*>(found) - data;
+            }
+            if (key_size > 0)
+                size = std::min(size, static_cast<size_t>(key_size));
+            key.assign(data, size);
+        }
+
+        frames.push_back(msg);
+        if (!socket->has_more())
+        {
+            table.put(key, frames);
+            ++ count;
+        }
+    }
+
+    socket->state().stats.conflated_messages += table.dropped();
+    OZ_out(0) = table.to_list();
+    OZ_out(1) = interrupted ? OZ_true() : OZ_false();
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+/** Get the bytes of a ByteString, or of a Message without copying them. */
+static bool get_bytes(OZ_Term term, const char*& data, size_t& size)
+{
+    if (OZ_isByteString(term))
+    {
+        ByteString* bs = tagged2ByteString(term);
+        data = reinterpret_cast<const char*>(bs->getData());
+        size = bs->getSize();
+        return true;
+    }
+    if (Message::is(term))
+    {
+        Message* msg = Message::coerce(term);
+        if (!msg->is_valid())
+            return false;
+        data = static_cast<const char*>(msg->data());
+        size = msg->size();
+        return true;
+    }
+    return false;
+}
+
+/** {ZN.sendToAll +SocketsL +Data +FlagsL ?ResultsL}
+
+Send the same frame to every socket, without waiting. 'Data' is a byte string,
+an open Message or a virtual string. The payload is copied into a frame once,
+or taken from the Message as it is, and each socket gets a zmq_msg_copy of it,
+which shares the content of large frames. 'ResultsL' tells, for each socket in order, whether it took the frame;
+false means it would have blocked.
+*/
+OZ_BI_define(ozzero_send_to_all, 3, 1)
+{
+    OZ_declareDetTerm(0, sockets_term);
+    OZ_declareDetTerm(1, data_term);
+    OZ_declareDetTerm(2, flags_term);
+
+    int flags;
+    PARSE_FLAGS(g_atom_decoder.send_recv_flags_map, "send/recv options",
+                2, flags_term, flags);
+    flags |= OZZERO_DONTWAIT;
+
+    std::vector<Socket*> sockets;
+    OZ_Term it = sockets_term;
+    for (; OZ_isCons(it); it = OZ_deref(OZ_tail(it)))
+    {
+        OZ_Term socket_term = OZ_deref(OZ_head(it));
+        if (OZ_isVariable(socket_term))
+            return OZ_suspendOnInternal(socket_term);
+        if (!Socket::is(socket_term))
+            return OZ_typeError(0, "list of Sockets");
+        Socket* socket = Socket::coerce(socket_term);
+        ENSURE_VALID(Socket, socket);
+        sockets.push_back(socket);
+    }
+    if (OZ_isVariable(it))
+        return OZ_suspendOnInternal(it);
+    if (!OZ_isNil(it))
+        return OZ_typeError(0, "list of Sockets");
+
+    zmq_msg_t original;
+    if (Message::is(data_term))
+    {
+        Message* message = Message::coerce(data_term);
+        ENSURE_VALID(Message, message);
+        zmq_msg_init(&original);
+        if (message->copy_to(&original) != 0)
+        {
+            int error_number = errno;
+            zmq_msg_close(&original);
+            errno = error_number;
+            return raise_error();
+        }
+    }
+    else
+    {
+        const char* data;
+        size_t size;
+        if (!get_bytes(data_term, data, size))
+        {
+            if (!OZ_isVirtualString(data_term, NULL))
+                return OZ_typeError(1, "VirtualString");
+            int length;
+            data = OZ_virtualStringToC(data_term, &length);
+            size = length;
+        }
+
+        if (zmq_msg_init_size(&original, size) != 0)
+            return raise_error();
+        if (size > 0)
+            memcpy(zmq_msg_data(&original), data, size);
+    }
+
+    std::vector<OZ_Term> results;
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    for (size_t i = 0; i < sockets.size(); ++ i)
+    {
+        int rc = zmq_msg_copy(&msg, &original);
+        if (rc == 0)
+            rc = sockets[i]->encode(&msg);
+        if (rc == 0)
+        {
+            do
+                rc = sockets[i]->send_raw(&msg, flags);
+            while (rc < 0 && errno == EINTR && !am.isSetSFlag(SigPending));
+        }
+
+        if (rc < 0 && errno != EAGAIN)
+        {
+            int error_number = errno;
+            zmq_msg_close(&msg);
+            zmq_msg_close(&original);
+            errno = error_number;
+            return raise_error();
+        }
+        results.push_back(rc >= 0 ? OZ_true() : OZ_false());
+    }
+    zmq_msg_close(&msg);
+    zmq_msg_close(&original);
+
+    OZ_RETURN(OZ_toList(results.size(), results.data()));
+}
+OZ_BI_end
+
+/** {ZN.offHeapStats ?StatsR}
+
+Memory held outside the Mozart heap by open messages and overflow spools.
+*/
+OZ_BI_define(ozzero_off_heap_stats, 0, 1)
+{
+    OZ_Term props[] = {
+        OZ_pairA("bytes", OZ_int64(g_off_heap.total())),
+        OZ_pairA("messageBytes", OZ_int64(g_off_heap.message_bytes)),
+        OZ_pairA("messages", OZ_int64(g_off_heap.messages)),
+        OZ_pairA("spoolBytes", OZ_int64(g_off_heap.spool_bytes)),
+        OZ_pairA("highWater", OZ_int64(g_off_heap.high_water)),
+        OZ_pairA("budget", OZ_int64(g_off_heap.budget)),
+        OZ_pairA("gcRequests", OZ_uint64(g_off_heap.gc_requests)),
+    };
+    OZ_Term prop_list = OZ_toList(sizeof(props)/sizeof(*props), props);
+    OZ_RETURN(OZ_recordInitC("offHeap", prop_list));
+}
+OZ_BI_end
+
+/** {ZN.offHeapBudget +BytesI}
+
+Request a GC whenever the off-heap memory grows beyond 'BytesI'. 0 disables it.
+*/
+OZ_BI_define(ozzero_off_heap_budget, 1, 0)
+{
+    OZ_declareLong(0, budget);
+    if (budget < 0)
+        return OZ_typeError(0, "nonnegative integer");
+    g_off_heap.set_budget(budget);
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+//}}}
+//------------------------------------------------------------------------------
+//{{{ Routing envelopes
+
+/** The routing envelope of a request received on a ROUTER socket: the
+identity frames up to and including the empty delimiter, as libzmq gave them.
+They are never decoded nor copied into Oz, and replying moves them back into
+libzmq as they are. */
+struct EnvelopeState
+{
+    std::vector<zmq_msg_t*> frames;
+
+    ~EnvelopeState()
+    {
+        for (size_t i = 0; i < frames.size(); ++ i)
+        {
+            zmq_msg_close(frames[i]);
+            delete frames[i];
+        }
+    }
+};
+
+int g_id_Envelope;
+class Envelope : public Extension<Envelope, EnvelopeState*, g_id_Envelope>
+{
+public:
+    explicit Envelope(EnvelopeState* obj) : Extension(obj) {}
+
+    bool is_valid() const { return _obj != NULL; }
+
+    virtual OZ_Term printV(int depth)
+    {
+        return OZ_mkTupleC("#", 3,
+                           OZ_atom("<Z14.Envelope "),
+                           OZ_int(_obj ? _obj->frames.size() : 0),
+                           OZ_atom(" frames>"));
+    }
+};
+
+/** Receive the rest of a multipart message after its first frame. The parts
+are queued together, so this only waits when a signal interrupts it. */
+static int recv_next_frame(Socket& socket, zmq_msg_t* msg)
+{
+    int rc;
+    do
+        rc = socket.recv_raw(msg, 0);
+    while (rc < 0 && errno == EINTR);
+    return rc;
+}
+
+/** {ZN.recvEnvelope +Socket ?EnvelopeOrUnit ?BodyL ?Interrupted}
+
+Receive a message from a ROUTER socket without waiting, and split it after the
+first empty frame. The frames up to there are kept in a native Envelope, and
+the others are returned as byte strings in 'BodyL'. A message without an empty
+frame (e.g. from a DEALER peer) only has its first frame in the envelope.
+'EnvelopeOrUnit' is unit if no message is queued.
+*/
+OZ_BI_define(ozzero_recv_envelope, 1, 3)
+{
+    OZ_declare(Socket, 0, socket);
+    ENSURE_VALID(Socket, socket);
+
+    EnvelopeState* envelope = new EnvelopeState;
+    std::vector<zmq_msg_t*>& frames = envelope->frames;
+    for (;;)
+    {
+        zmq_msg_t* msg = new zmq_msg_t;
+        zmq_msg_init(msg);
+        int rc = frames.empty() ? socket->recv_raw(msg, OZZERO_DONTWAIT) : recv_next_frame(*socket, msg);
+        if (rc < 0)
+        {
+            int error_number = errno;
+            zmq_msg_close(msg);
+            delete msg;
+            delete envelope;
+            if (error_number == EAGAIN || (error_number == EINTR && !am.isSetSFlag(SigPending)))
+            {
+                OZ_out(0) = OZ_unit();
+                OZ_out(1) = OZ_nil();
+                OZ_out(2) = error_number == EINTR ? OZ_true() : OZ_false();
+                return OZ_ENTAILED;
+            }
+            errno = error_number;
+            return raise_error();
+        }
+        frames.push_back(msg);
+        if (!socket->has_more())
+            break;
+    }
+
+    size_t body_start = 1;
+    for (size_t i = 1; i < frames.size(); ++ i)
+    {
+        if (zmq_msg_size(frames[i]) == 0)
+        {
+            body_start = i + 1;
+            break;
+        }
+    }
+
+    std::vector<OZ_Term> body;
+    for (size_t i = body_start; i < frames.size(); ++ i)
+    {
+        zmq_msg_t* msg = frames[i];
+        if (socket->decode(msg) < 0)
+        {
+            int error_number = errno;
+            delete envelope;
+            errno = error_number;
+            return raise_error();
+        }
+        body.push_back(OZ_mkByteString(static_cast<const char*>(zmq_msg_data(msg)),
+                                       zmq_msg_size(msg)));
+    }
+    for (size_t i = body_start; i < frames.size(); ++ i)
+    {
+        zmq_msg_close(frames[i]);
+        delete frames[i];
+    }
+    frames.resize(body_start);
+
+    OZ_out(0) = OZ_extension(new Envelope(envelope));
+    OZ_out(1) = OZ_toList(body.size(), body.data());
+    OZ_out(2) = OZ_false();
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+/** {ZN.reply +Socket +Envelope +BodyL ?Completed ?Interrupted}
+
+Send the frames of 'Envelope' followed by 'BodyL', a list of byte strings,
+open Messages or virtual strings, as one message, without waiting. The envelope
+frames are moved into libzmq, so the envelope can be used only once; it is
+left untouched if the message could not be sent.
+*/
+OZ_BI_define(ozzero_reply, 3, 2)
+{
+    OZ_declare(Socket, 0, socket);
+    ENSURE_VALID(Socket, socket);
+    OZ_declare(Envelope, 1, envelope);
+    ENSURE_VALID(Envelope, envelope);
+    OZ_declareDetTerm(2, body_term);
+
+    // Build every body frame first, so that bad input never leaves half a
+    // message behind.
+    std::vector<zmq_msg_t*> body;
+    OZ_Return error = OZ_ENTAILED;
+    OZ_Term it = body_term;
+    for (; error == OZ_ENTAILED && OZ_isCons(it); it = OZ_deref(OZ_tail(it)))
+    {
+        OZ_Term part = OZ_deref(OZ_head(it));
+        const char* data = NULL;
+        size_t size;
+        VirtualStringGather gather;
+        if (!get_bytes(part, data, size))
+        {
+            VirtualStringGather::Result result = gather.add(part);
+            if (result == VirtualStringGather::UNBOUND)
+            {
+                error = OZ_suspendOnInternal(gather.unbound());
+                break;
+            }
+            if (result == VirtualStringGather::NOT_VS)
+            {
+                error = OZ_typeError(2, "list of VirtualStrings");
+                break;
+            }
+            size = gather.size();
+        }
+
+        zmq_msg_t* msg = new zmq_msg_t;
+        if (zmq_msg_init_size(msg, size) != 0)
+        {
+            delete msg;
+            error = raise_error();
+            break;
+        }
+        body.push_back(msg);
+        if (data != NULL)
+            memcpy(zmq_msg_data(msg), data, size);
+        else
+            gather.write(static_cast<char*>(zmq_msg_data(msg)));
+        if (socket->encode(msg) < 0)
+            error = raise_error();
+    }
+    if (error == OZ_ENTAILED && OZ_isVariable(it))
+        error = OZ_suspendOnInternal(it);
+    else if (error == OZ_ENTAILED && !OZ_isNil(it))
+        error = OZ_typeError(2, "list of VirtualStrings");
+
+    std::vector<zmq_msg_t*>& frames = envelope->_obj->frames;
+    size_t total = frames.size() + body.size();
+    int rc = 0;
+    bool started = false;
+    for (size_t i = 0; error == OZ_ENTAILED && i < total; ++ i)
+    {
+        zmq_msg_t* msg = i < frames.size() ? frames[i] : body[i - frames.size()];
+        int flags = i + 1 < total ? ZMQ_SNDMORE : 0;
+        if (i == 0)
+            rc = socket->send_raw(msg, flags | OZZERO_DONTWAIT);
+        else
+        {
+            // Once the first frame is queued, the rest cannot be refused.
+            do
+                rc = socket->send_raw(msg, flags);
+            while (rc < 0 && errno == EINTR);
+            if (rc < 0)
+                error = raise_error();
+        }
+        if (rc < 0)
+            break;
+        started = true;
+    }
+
+    for (size_t i = 0; i < body.size(); ++ i)
+    {
+        zmq_msg_close(body[i]);
+        delete body[i];
+    }
+    if (started)
+    {
+        delete envelope->_obj;
+        envelope->_obj = NULL;
+    }
+    if (error != OZ_ENTAILED)
+        return error;
+    return completion(rc, OZ_out(0), OZ_out(1));
+}
+OZ_BI_end
+
+/** {ZN.envelopeFrames +Envelope ?BSL}
+
+The frames of an envelope as byte strings, e.g. to tell which peer sent the
+request.
+*/
+OZ_BI_define(ozzero_envelope_frames, 1, 1)
+{
+    OZ_declare(Envelope, 0, envelope);
+    ENSURE_VALID(Envelope, envelope);
+
+    std::vector<zmq_msg_t*>& frames = envelope->_obj->frames;
+    std::vector<OZ_Term> terms;
+    for (size_t i = 0; i < frames.size(); ++ i)
+        terms.push_back(OZ_mkByteString(static_cast<const char*>(zmq_msg_data(frames[i])),
+                                        zmq_msg_size(frames[i])));
+    OZ_RETURN(OZ_toList(terms.size(), terms.data()));
+}
+OZ_BI_end
+
+/** {ZN.envelopeClose +Envelope}
+
+Drop an envelope without replying. Does nothing if it was used already.
+*/
+OZ_BI_define(ozzero_envelope_close, 1, 0)
+{
+    OZ_declare(Envelope, 0, envelope);
+    delete envelope->_obj;
+    envelope->_obj = NULL;
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+//}}}
+//------------------------------------------------------------------------------
+//{{{ Capture and replay
+
+/** {ZN.captureStart +Socket +PathV}
+
+Record every frame the socket sends or receives from now on to a new capture
+log at 'PathV', replacing any capture in progress.
+*/
+OZ_BI_define(ozzero_capture_start, 2, 0)
+{
+    OZ_declare(Socket, 0, socket);
+    ENSURE_VALID(Socket, socket);
+    OZ_declareVirtualString(1, path);
+
+    CaptureLog* capture = CaptureLog::create(path);
+    if (capture == NULL)
+        return raise_error();
+    delete socket->state().capture;
+    socket->state().capture = capture;
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+/** {ZN.captureStop +Socket ?StatsR}
+
+Flush and close the capture log of the socket. 'StatsR' is
+'capture(frames:FramesI bytes:BytesI)', or unit if there was no capture.
+Raises if the log could not be written completely.
+*/
+OZ_BI_define(ozzero_capture_stop, 1, 1)
+{
+    OZ_declare(Socket, 0, socket);
+    ENSURE_VALID(Socket, socket);
+
+    CaptureLog* capture = socket->state().capture;
+    if (capture == NULL)
+        OZ_RETURN(OZ_unit());
+    socket->state().capture = NULL;
+
+    capture->flush();
+    int error_number = capture->error();
+    OZ_Term props[] = {
+        OZ_pairA("frames", OZ_uint64(capture->frames)),
+        OZ_pairA("bytes", OZ_uint64(capture->bytes)),
+    };
+    delete capture;
+    if (error_number != 0)
+    {
+        errno = error_number;
+        return raise_error();
+    }
+    OZ_RETURN(OZ_recordInitC("capture", OZ_toList(sizeof(props)/sizeof(*props), props)));
+}
+OZ_BI_end
+
+/** A capture log being replayed. The file is mapped, and its frames are copied
+straight from the mapping into new frames. */
+struct ReplayState
+{
+    const char* data;
+    size_t length;
+    size_t offset;
+    /** CAPTURE_RECEIVED to replay the received frames, 0 for the sent ones,
+    or -1 for both. */
+    int direction;
+
+    /** When the first message was replayed, and its time in the log. */
+    bool started;
+    uint64_t start_ns;
+    uint64_t base_ns;
+    bool in_message;
+
+    uint64_t frames;
+    uint64_t bytes;
+
+    ReplayState()
+        : data(NULL), length(0), offset(sizeof(CAPTURE_MAGIC)), direction(0),
+          started(false), start_ns(0), base_ns(0), in_message(false), frames(0), bytes(0)
+    {}
+
+    ~ReplayState()
+    {
+        if (data != NULL)
+            munmap(const_cast<char*>(data), length);
+    }
+
+    /** Read the next record to replay, skipping the other direction. Returns
+    false at the end of the log, or with 'error_number' set to EPROTO if the
+    record is truncated. Records are not aligned, hence the copy. */
+    bool next(CaptureRecord& record, int& error_number)
+    {
+        error_number = 0;
+        while (offset < length)
+        {
+            if (length - offset < sizeof(CaptureRecord))
+                break;
+            memcpy(&record, data + offset, sizeof(CaptureRecord));
+            if (length - offset - sizeof(CaptureRecord) < record.size)
+                break;
+            if (direction < 0 || static_cast<int>(record.flags & CAPTURE_RECEIVED) == direction)
+                return true;
+            offset += sizeof(CaptureRecord) + record.size;
+        }
+        if (offset < length)
+            error_number = EPROTO;
+        return false;
+    }
+};
+
+int g_id_Replay;
+class Replay : public Extension<Replay, ReplayState*, g_id_Replay>
+{
+public:
+    explicit Replay(ReplayState* obj) : Extension(obj) {}
+
+    bool is_valid() const { return _obj != NULL; }
+
+    virtual OZ_Term printV(int depth)
+    {
+        return OZ_mkTupleC("#", 3,
+                           OZ_atom("<Z14.Replay "),
+                           OZ_uint64(_obj ? _obj->frames : 0),
+                           OZ_atom(" frames>"));
+    }
+};
+
+/** {ZN.replayOpen +PathV +DirectionA ?Replay}
+
+Open a capture log for replaying the frames that were 'sent', 'received' or
+'all' of them.
+*/
+OZ_BI_define(ozzero_replay_open, 2, 1)
+{
+    OZ_declareVirtualString(0, path);
+    OZ_declareAtom(1, direction_name);
+
+    int direction;
+    if (strcmp(direction_name, "sent") == 0)
+        direction = 0;
+    else if (strcmp(direction_name, "received") == 0)
+        direction = CAPTURE_RECEIVED;
+    else if (strcmp(direction_name, "all") == 0)
+        direction = -1;
+    else
+        return OZ_typeError(1, "'sent', 'received' or 'all'");
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return raise_error();
+    struct stat st;
+    void* data = MAP_FAILED;
+    if (fstat(fd, &st) != 0)
+        ;
+    else if (static_cast<size_t>(st.st_size) < sizeof(CAPTURE_MAGIC))
+        errno = EPROTO;
+    else
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    int error_number = errno;
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        errno = error_number;
+        return raise_error();
+    }
+
+    ReplayState* state = new ReplayState;
+    state->data = static_cast<const char*>(data);
+    state->length = st.st_size;
+    state->direction = direction;
+    if (memcmp(state->data, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0)
+    {
+        delete state;
+        errno = EPROTO;
+        return raise_error();
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    OZ_RETURN(OZ_extension(new Replay(state)));
+}
+OZ_BI_end
+
+/** {ZN.replayStep +Replay +Socket +SpeedI +MaxI ?ResultA}
+
+Send the frames of the log which are due, at most 'MaxI' of them, without
+waiting. 'SpeedI' is the replay speed in thousandths of the original one; 0
+replays as fast as the socket takes the frames. The result is 'done' at the end
+of the log, 'wait(MsI)' when the next message is due in 'MsI' milliseconds
+(rounded up; 0 if 'MaxI' frames were sent), 'blocked' when the socket refused
+the next frame, and 'interrupted' after a signal.
+*/
+OZ_BI_define(ozzero_replay_step, 4, 1)
+{
+    OZ_declare(Replay, 0, replay);
+    ENSURE_VALID(Replay, replay);
+    OZ_declare(Socket, 1, socket);
+    ENSURE_VALID(Socket, socket);
+    OZ_declareLong(2, speed);
+    OZ_declareLong(3, max_count);
+
+    ReplayState* state = replay->_obj;
+    for (long count = 0; max_count < 0 || count < max_count; ++ count)
+    {
+        int error_number;
+        CaptureRecord record;
+        if (!state->next(record, error_number))
+        {
+            if (error_number != 0)
+            {
+                errno = error_number;
+                return raise_error();
+            }
+            OZ_RETURN(OZ_atom("done"));
+        }
+
+        // Only the first frame of a message waits for its time, and may be
+        // refused.
+        if (!state->in_message)
+        {
+            uint64_t now = monotonic_ns();
+            if (!state->started)
+            {
+                state->started = true;
+                state->start_ns = now;
+                state->base_ns = record.time_ns;
+            }
+            if (speed > 0)
+            {
+                uint64_t due = state->start_ns
+                             + (record.time_ns - state->base_ns) * 1000 / static_cast<uint64_t>(speed);
+                // Rounded up, so that a wait of less than a millisecond
+                // does not come back here at once.
+                if (due > now)
+                    OZ_RETURN(OZ_mkTupleC("wait", 1, OZ_int(static_cast<int>(
+                        std::min<uint64_t>((due - now + 999999) / 1000000, INT_MAX)))));
+            }
+        }
+
+        zmq_msg_t msg;
+        if (zmq_msg_init_size(&msg, record.size) != 0)
+            return raise_error();
+        memcpy(zmq_msg_data(&msg), state->data + state->offset + sizeof(CaptureRecord), record.size);
+
+        bool more = (record.flags & CAPTURE_MORE) != 0;
+        int flags = more ? ZMQ_SNDMORE : 0;
+        int rc;
+        if (state->in_message)
+        {
+            do
+                rc = socket->send_raw(&msg, flags);
+            while (rc < 0 && errno == EINTR);
+        }
+        else
+            rc = socket->send_raw(&msg, flags | OZZERO_DONTWAIT);
+        error_number = errno;
+        zmq_msg_close(&msg);
+
+        if (rc < 0)
+        {
+            if (error_number == EAGAIN && !state->in_message)
+                OZ_RETURN(OZ_atom("blocked"));
+            if (error_number == EINTR && !state->in_message && !am.isSetSFlag(SigPending))
+                OZ_RETURN(OZ_atom("interrupted"));
+            errno = error_number;
+            return raise_error();
+        }
+
+        state->offset += sizeof(CaptureRecord) + record.size;
+        state->in_message = more;
+        ++ state->frames;
+        state->bytes += record.size;
+    }
+    OZ_RETURN(OZ_mkTupleC("wait", 1, OZ_int(0)));
+}
+OZ_BI_end
+
+/** {ZN.replayClose +Replay ?StatsR}
+
+'StatsR' is 'replay(frames:FramesI bytes:BytesI micros:MicrosI)', the time
+being counted from the first frame replayed.
+*/
+OZ_BI_define(ozzero_replay_close, 1, 1)
+{
+    OZ_declare(Replay, 0, replay);
+    ENSURE_VALID(Replay, replay);
+
+    ReplayState* state = replay->_obj;
+    uint64_t elapsed_ns = state->started ? monotonic_ns() - state->start_ns : 0;
+    OZ_Term props[] = {
+        OZ_pairA("frames", OZ_uint64(state->frames)),
+        OZ_pairA("bytes", OZ_uint64(state->bytes)),
+        OZ_pairA("micros", OZ_uint64(elapsed_ns / 1000)),
+    };
+    delete state;
+    replay->_obj = NULL;
+    OZ_RETURN(OZ_recordInitC("replay", OZ_toList(sizeof(props)/sizeof(*props), props)));
+}
+OZ_BI_end
+
+//}}}
+//------------------------------------------------------------------------------
+//{{{ Local term passing
+
+/** An Oz term sent to a socket of this process. The frame sent points right at
+the slot, and inproc pipes pass frames by reference, so a receiver finding the
+address of a live slot in its frame knows that the frame never left the
+process, and can take the term as it is. */
+struct TermSlot
+{
+    uint32_t magic;
+    OZ_Term term;
+};
+
+static const uint32_t TERM_SLOT_MAGIC = 0x4f7a5431;     // "OzT1"
+
+/** Slots still referenced by some frame. Only used by the emulator thread. */
+static std::set<TermSlot*> g_term_slots;
+
+/** Slots whose frames libzmq has freed, possibly from an I/O thread. They are
+unprotected by the emulator thread on the next term operation, recvAll or
+socket close. */
+static pthread_mutex_t g_released_slots_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<TermSlot*> g_released_slots;
+
+static void release_term_slot(void* data, void*)
+{
+    pthread_mutex_lock(&g_released_slots_mutex);
+    g_released_slots.push_back(static_cast<TermSlot*>(data));
+    pthread_mutex_unlock(&g_released_slots_mutex);
+}
+
+static void collect_term_slots()
+{
+    std::vector<TermSlot*> released;
+    pthread_mutex_lock(&g_released_slots_mutex);
+    released.swap(g_released_slots);
+    pthread_mutex_unlock(&g_released_slots_mutex);
+
+    for (size_t i = 0; i < released.size(); ++ i)
+    {
+        g_term_slots.erase(released[i]);
+        OZ_unprotect(&released[i]->term);
+        delete released[i];
+    }
+}
+
+/** The slot a received frame points to, or NULL if it is ordinary data. */
+static TermSlot* find_term_slot(zmq_msg_t* msg)
+{
+    if (zmq_msg_size(msg) != sizeof(TermSlot))
+        return NULL;
+    uint32_t magic;
+    memcpy(&magic, zmq_msg_data(msg), sizeof(magic));
+    if (magic != TERM_SLOT_MAGIC)
+        return NULL;
+    std::set<TermSlot*>::iterator it = g_term_slots.find(static_cast<TermSlot*>(zmq_msg_data(msg)));
+    return it == g_term_slots.end() ? NULL : *it;
+}
+
+/** {ZN.termSend +Socket +Term +FlagsL ?Completed ?Interrupted}
+
+Send a reference to 'Term' as a frame. Only a socket of this process connected
+through inproc can make sense of it, so this must not be used on sockets with
+other transports. The frame bypasses compression and the overflow spool. Its
+bytes are the slot itself, so a SUB socket only receives it when subscribed to
+everything ("").
+*/
+OZ_BI_define(ozzero_term_send, 3, 2)
+{
+    OZ_declare(Socket, 0, socket);
+    ENSURE_VALID(Socket, socket);
+    OZ_declareTerm(1, term);
+    OZ_declareDetTerm(2, flags_term);
+
+    int flags;
+    PARSE_FLAGS(g_atom_decoder.send_recv_flags_map, "send/recv options",
+                2, flags_term, flags);
+
+    collect_term_slots();
+
+    TermSlot* slot = new TermSlot;
+    slot->magic = TERM_SLOT_MAGIC;
+    slot->term = term;
+    OZ_protect(&slot->term);
+    g_term_slots.insert(slot);
+
+    zmq_msg_t msg;
+    if (zmq_msg_init_data(&msg, slot, sizeof(TermSlot), release_term_slot, NULL) != 0)
+    {
+        int error_number = errno;
+        g_term_slots.erase(slot);
+        OZ_unprotect(&slot->term);
+        delete slot;
+        errno = error_number;
+        return raise_error();
+    }
+
+    // If the frame was not queued, closing it releases the slot.
+    int rc = socket->send_now(&msg, flags);
+    int error_number = errno;
+    zmq_msg_close(&msg);
+    errno = error_number;
+    return completion(rc, OZ_out(0), OZ_out(1));
+}
+OZ_BI_end
+
+/** {ZN.termRecv +Socket +FlagsL ?Term ?Completed ?Interrupted}
+
+Receive a frame. If it was sent with termSend from this process, 'Term' is the
+very term sent; otherwise it is the content of the frame as a byte string.
+'Term' is unit if nothing was received.
+*/
+OZ_BI_define(ozzero_term_recv, 2, 3)
+{
+    OZ_declare(Socket, 0, socket);
+    ENSURE_VALID(Socket, socket);
+    OZ_declareDetTerm(1, flags_term);
+
+    int flags;
+    PARSE_FLAGS(g_atom_decoder.send_recv_flags_map, "send/recv options",
+                1, flags_term, flags);
+
+    zmq_msg_t msg;
+    if (zmq_msg_init(&msg) != 0)
+        return raise_error();
+
+    int rc = socket->recv_raw(&msg, flags);
+    OZ_out(0) = OZ_unit();
+    if (rc >= 0)
+    {
+        TermSlot* slot = find_term_slot(&msg);
+        if (slot != NULL)
+            OZ_out(0) = slot->term;
+        else if (socket->decode(&msg) >= 0)
+            OZ_out(0) = OZ_mkByteString(static_cast<const char*>(zmq_msg_data(&msg)),
+                                        zmq_msg_size(&msg));
+        else
+            rc = -1;
+    }
+
+    int error_number = errno;
+    zmq_msg_close(&msg);
+    collect_term_slots();
+    errno = error_number;
+    return completion(rc, OZ_out(1), OZ_out(2));
+}
+OZ_BI_end
+
+//}}}
+//------------------------------------------------------------------------------
+//{{{ Scanning
+
+#define OZ_declareBytes(argNum, dataVar, sizeVar) \
+    const char* dataVar; \
+    size_t sizeVar; \
+    do \
+    { \
+        OZ_declareDetTerm(argNum, _xx_bytes_term); \
+        if (!get_bytes(_xx_bytes_term, dataVar, sizeVar)) \
+            return OZ_typeError(argNum, "ByteString or open Message"); \
+    } while (0)
+
+/** {ZN.bytesSplit +Bytes +DelimI ?FieldsL}
+
+Split at every occurrence of the byte 'DelimI' into a list of byte strings.
+*/
+OZ_BI_define(ozzero_bytes_split, 2, 1)
+{
+    OZ_declareBytes(0, data, size);
+    OZ_declareInt(1, delimiter);
+
+    std::vector<OZ_Term> fields;
+    const char* end = data + size;
+    for (;;)
+    {
+        // glibc's memchr scans with SSE2/AVX2, many bytes per step.
+        const char* found = static_cast<const char*>(memchr(data, delimiter, end - data));
+        const char* field_end = found != NULL ? found : end;
+        fields.push_back(OZ_mkByteString(data, field_end - data));
+        if (found == NULL)
+            break;
+        data = found + 1;
+    }
+    OZ_RETURN(OZ_toList(fields.size(), fields.data()));
+}
+OZ_BI_end
+
+/** {ZN.bytesFind +Bytes +ByteI +OffsetI ?IndexI}
+
+The index of the first 'ByteI' at or after 'OffsetI', or ~1.
+*/
+OZ_BI_define(ozzero_bytes_find, 3, 1)
+{
+    OZ_declareBytes(0, data, size);
+    OZ_declareInt(1, byte);
+    OZ_declareLong(2, offset);
+
+    if (offset < 0 || static_cast<size_t>(offset) >= size)
+        OZ_RETURN_INT(-1);
+    const char* found = static_cast<const char*>(memchr(data + offset, byte, size - offset));
+    OZ_RETURN(OZ_long(found == NULL ? -1 : found - data));
+}
+OZ_BI_end
+
+/** {ZN.bytesSlice +Bytes +OffsetI +LengthI ?BS}
+
+Copy 'LengthI' bytes from 'OffsetI' (to the end if negative) into a new byte
+string.
+*/
+OZ_BI_define(ozzero_bytes_slice, 3, 1)
+{
+    OZ_declareBytes(0, data, size);
+    OZ_declareLong(1, offset);
+    OZ_declareLong(2, length);
+
+    if (offset < 0 || static_cast<size_t>(offset) > size)
+        return OZ_typeError(1, "offset within the data");
+    size_t available = size - offset;
+    size_t count = length < 0 ? available : std::min(available, static_cast<size_t>(length));
+    OZ_RETURN(OZ_mkByteString(data + offset, count));
+}
+OZ_BI_end
+
+/** {ZN.bytesParseInt +Bytes +OffsetI ?IntOrUnit ?EndI}
+
+Parse a decimal integer at 'OffsetI', with an optional sign ('-' or '~'). Binds
+'IntOrUnit' to unit if there are no digits there. 'EndI' is the index right
+after the number.
+*/
+OZ_BI_define(ozzero_bytes_parse_int, 2, 2)
+{
+    OZ_declareBytes(0, data, size);
+    OZ_declareLong(1, offset);
+
+    size_t i = offset < 0 ? size : static_cast<size_t>(offset);
+    bool negative = false;
+    if (i < size && (data[i] == '-' || data[i] == '~' || data[i] == '+'))
+    {
+        negative = data[i] != '+';
+        ++ i;
+    }
+
+    size_t digits_start = i;
+    uint64_t value = 0;
+    bool overflow = false;
+    while (i < size && data[i] >= '0' && data[i] <= '9')
+    {
+        if (value > (~0ULL - 9) / 10)
+            overflow = true;
+        value = value * 10 + (data[i] - '0');
+        ++ i;
+    }
+
+    if (i == digits_start)
+    {
+        OZ_out(0) = OZ_unit();
+        OZ_out(1) = OZ_long(offset);
+    }
+    else if (overflow || value > 0x7fffffffffffffffULL)
+    {
+        // Let Mozart build the big integer.
+        std::string digits (negative ? "~" : "");
+        digits.append(data + digits_start, i - digits_start);
+        OZ_out(0) = OZ_CStringToInt(digits.c_str());
+        OZ_out(1) = OZ_long(i);
+    }
+    else
+    {
+        int64_t signed_value = static_cast<int64_t>(value);
+        OZ_out(0) = OZ_int64(negative ? -signed_value : signed_value);
+        OZ_out(1) = OZ_long(i);
+    }
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+/** {ZN.bytesParseFloat +Bytes +OffsetI ?FloatOrUnit ?EndI}
+
+Parse a decimal number at 'OffsetI'. Both C ('-1.5e-3') and Oz ('~1.5e~3')
+signs are accepted.
+*/
+OZ_BI_define(ozzero_bytes_parse_float, 2, 2)
+{
+    OZ_declareBytes(0, data, size);
+    OZ_declareLong(1, offset);
+
+    size_t start = offset < 0 ? size : static_cast<size_t>(offset);
+    size_t end = start;
+    char buffer[64];
+    while (end < size && end - start < sizeof(buffer) - 1)
+    {
+        char c = data[end];
+        if (!((c >= '0' && c <= '9') || c == '.' || c == 'e' || c == 'E'
+                || c == '-' || c == '+' || c == '~'))
+            break;
+        buffer[end - start] = c == '~' ? '-' : c;
+        ++ end;
+    }
+    buffer[end - start] = '\0';
+
+    char* parsed_end;
+    double value = strtod(buffer, &parsed_end);
+    if (parsed_end == buffer)
+    {
+        OZ_out(0) = OZ_unit();
+        OZ_out(1) = OZ_long(offset);
+    }
+    else
+    {
+        OZ_out(0) = OZ_float(value);
+        OZ_out(1) = OZ_long(start + (parsed_end - buffer));
+    }
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+/** {ZN.bytesHasPrefix +Bytes +PrefixVS ?Bool} */
+OZ_BI_define(ozzero_bytes_has_prefix, 2, 1)
+{
+    OZ_declareBytes(0, data, size);
+    const char* prefix;
+    size_t prefix_size;
+    OZ_declareDetTerm(1, prefix_term);
+    if (!get_bytes(prefix_term, prefix, prefix_size))
+    {
+        if (!OZ_isVirtualString(prefix_term, NULL))
+            return OZ_typeError(1, "VirtualString");
+        int length;
+        prefix = OZ_virtualStringToC(prefix_term, &length);
+        prefix_size = length;
+    }
+
+    bool matches = prefix_size <= size && memcmp(data, prefix, prefix_size) == 0;
+    OZ_RETURN(matches ? OZ_true() : OZ_false());
+}
+OZ_BI_end
+
+#undef OZ_declareBytes
+
+//}}}
+//------------------------------------------------------------------------------
+//{{{ File mapping
+
+/** A read-only mapping of a file region, shared by all the frames pointing into
+it. It is unmapped when libzmq releases the last of those frames, which may
+happen on one of its I/O threads. */
+struct FileMapping
+{
+    void* base;
+    size_t length;
+    int refcount;
+
+    FileMapping(void* base_, size_t length_, int refcount_)
+        : base(base_), length(length_), refcount(refcount_) {}
+
+    static void release(void*, void* hint)
+    {
+        FileMapping* mapping = static_cast<FileMapping*>(hint);
+        if (__sync_sub_and_fetch(&mapping->refcount, 1) == 0)
+        {
+            munmap(mapping->base, mapping->length);
+            delete mapping;
+        }
+    }
+};
+
+/** {ZN.msgsFromFile +PathVS +OffsetI +LengthI +ChunkI ?MessageL}
+
+Map 'LengthI' bytes of the file starting at 'OffsetI' and return messages which
+point directly into the mapping, each at most 'ChunkI' bytes long. A negative
+length means up to the end of the file; a nonpositive chunk size means a single
+message.
+*/
+OZ_BI_define(ozzero_msgs_from_file, 4, 1)
+{
+    OZ_declareVirtualString(0, path);
+    OZ_declareDetTerm(1, offset_term);
+    OZ_declareDetTerm(2, length_term);
+    OZ_declareLong(3, chunk);
+    if (!OZ_isInt(offset_term))
+        return OZ_typeError(1, "Int");
+    if (!OZ_isInt(length_term))
+        return OZ_typeError(2, "Int");
+    int64_t offset = OZ_intToCint64(offset_term);
+    int64_t length = OZ_intToCint64(length_term);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return raise_error();
+
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0)
+    {
+        int error_number = errno;
+        close(fd);
+        errno = error_number;
+        return raise_error();
+    }
+
+    int64_t file_size = file_stat.st_size;
+    if (length < 0)
+        length = file_size - offset;
+    if (offset < 0 || length < 0 || offset + length > file_size
+            || static_cast<uint64_t>(length) > static_cast<size_t>(-1))
+    {
+        close(fd);
+        errno = EINVAL;
+        return raise_error();
+    }
+
+    if (length == 0)
+    {
+        close(fd);
+        Message* msg = new Message();
+        msg->init();
+        OZ_Term msg_term = OZ_extension(msg);
+        OZ_RETURN(OZ_toList(1, &msg_term));
+    }
+
+    size_t total = static_cast<size_t>(length);
+    size_t chunk_size = (chunk <= 0 || static_cast<size_t>(chunk) > total) ? total : chunk;
+    size_t chunk_count = (total + chunk_size - 1) / chunk_size;
+
+    int64_t page_size = sysconf(_SC_PAGESIZE);
+    int64_t map_offset = offset - offset % page_size;
+    size_t map_length = total + static_cast<size_t>(offset - map_offset);
+    void* base = mmap(NULL, map_length, PROT_READ, MAP_SHARED, fd, map_offset);
+    int error_number = errno;
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        errno = error_number;
+        return raise_error();
+    }
+    madvise(base, map_length, MADV_SEQUENTIAL);
+
+    FileMapping* mapping = new FileMapping(base, map_length, chunk_count);
+    char* data = static_cast<char*>(base) + (offset - map_offset);
+
+    std::vector<Message*> msgs;
+    msgs.reserve(chunk_count);
+    for (size_t i = 0; i < chunk_count; ++ i)
+    {
+        size_t position = i * chunk_size;
+        size_t size = std::min(chunk_size, total - position);
+        Message* msg = new Message();
+        if (msg->init_data(data + position, size, FileMapping::release, mapping) != 0)
+        {
+            error_number = errno;
+            delete msg;
+            for (size_t j = 0; j < i; ++ j)
+                delete msgs[j];
+            for (size_t j = i; j < chunk_count; ++ j)
+                FileMapping::release(NULL, mapping);
+            errno = error_number;
+            return raise_error();
+        }
+        msgs.push_back(msg);
+    }
+
+    std::vector<OZ_Term> msg_terms;
+    msg_terms.reserve(chunk_count);
+    for (size_t i = 0; i < chunk_count; ++ i)
+        msg_terms.push_back(OZ_extension(msgs[i]));
+    OZ_RETURN(OZ_toList(msg_terms.size(), msg_terms.data()));
+}
+OZ_BI_end
+
+/** Write the whole buffer to 'fd', at 'offset' if it is nonnegative. */
+static int write_fully(int fd, const char* data, size_t size, int64_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t written = offset < 0 ? write(fd, data, size) : pwrite(fd, data, size, offset);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += written;
+        size -= written;
+        if (offset >= 0)
+            offset += written;
+    }
+    return 0;
+}
+
+/** Where recvToFile writes the frames it receives. */
+struct FileSinkState
+{
+    int fd;
+    bool owns_fd;
+
+    /** Offset of the next write, or -1 to write sequentially to a borrowed fd
+    which may not be seekable. */
+    int64_t offset;
+
+    uint64_t total;
+    uLong crc;
+
+    bool has_terminator;
+    std::string terminator;
+    bool done;
+
+    FileSinkState(int fd_, bool owns_fd_)
+        : fd(fd_), owns_fd(owns_fd_), offset(owns_fd_ ? 0 : -1),
+          total(0), crc(crc32(0, Z_NULL, 0)), has_terminator(false), done(false) {}
+
+    int close()
+    {
+        int rc = 0;
+        if (owns_fd && fd >= 0)
+            rc = ::close(fd);
+        fd = -1;
+        return rc;
+    }
+
+    /** Consume a received frame. Returns -1 if writing failed. */
+    int consume(zmq_msg_t* msg, bool more)
+    {
+        const char* data = static_cast<const char*>(zmq_msg_data(msg));
+        size_t size = zmq_msg_size(msg);
+
+        if (has_terminator && size == terminator.size()
+                && memcmp(data, terminator.data(), size) == 0)
+        {
+            done = true;
+            return 0;
+        }
+
+        if (write_fully(fd, data, size, offset) != 0)
+            return -1;
+        if (offset >= 0)
+            offset += size;
+        total += size;
+        crc = crc32(crc, reinterpret_cast<const Bytef*>(data), size);
+
+        if (!has_terminator && !more)
+            done = true;
+        return 0;
+    }
+};
+
+int g_id_FileSink;
+class FileSink : public Extension<FileSink, FileSinkState*, g_id_FileSink>
+{
+public:
+    explicit FileSink(FileSinkState* obj) : Extension(obj) {}
+
+    bool is_valid() const { return _obj != NULL; }
+
+    virtual OZ_Term printV(int depth)
+    {
+        return OZ_mkTupleC("#", 3,
+                           OZ_atom("<Z14.FileSink "),
+                           OZ_int(_obj ? _obj->fd : -1),
+                           OZ_atom(">"));
+    }
+};
+
+/** {ZN.sinkOpen +Target +TerminatorBS ?FileSink}
+
+If 'Target' is an integer, it is an already opened file descriptor which the
+frames are appended to. Otherwise it is the path of a file to be truncated and
+written from the start. 'TerminatorBS' may be 'unit', in which case the sink
+stops at the end of a multipart message instead of at a frame equal to it.
+*/
+OZ_BI_define(ozzero_sink_open, 2, 1)
+{
+    OZ_declareDetTerm(0, target_term);
+    OZ_declareDetTerm(1, terminator_term);
+
+    bool has_terminator = !OZ_isUnit(terminator_term);
+    if (has_terminator && !OZ_isByteString(terminator_term))
+        return OZ_typeError(1, "ByteString or unit");
+
+    FileSinkState* state;
+    if (OZ_isInt(target_term))
+    {
+        state = new FileSinkState(OZ_intToC(target_term), false);
+    }
+    else
+    {
+        OZ_declareVirtualString(0, path);
+        int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (fd < 0)
+            return raise_error();
+        state = new FileSinkState(fd, true);
+    }
+
+    if (has_terminator)
+    {
+        ByteString* bs = tagged2ByteString(terminator_term);
+        state->has_terminator = true;
+        state->terminator.assign(reinterpret_cast<const char*>(bs->getData()), bs->getSize());
+    }
+
+    OZ_RETURN(OZ_extension(new FileSink(state)));
+}
+OZ_BI_end
+
+/** {ZN.sinkRecv +FileSink +Socket ?Completed ?Interrupted}
+
+Receive and write as many frames as are available without blocking. Only one
+frame is held in memory at a time. 'Completed' is true once the sink has seen
+the end of the transfer.
+*/
+OZ_BI_define(ozzero_sink_recv, 2, 2)
+{
+    OZ_declare(FileSink, 0, sink);
+    ENSURE_VALID(FileSink, sink);
+    OZ_declare(Socket, 1, socket);
+    ENSURE_VALID(Socket, socket);
+
+    FileSinkState* state = sink->_obj;
+    bool interrupted = false;
+    zmq_msg_t msg;
+
+    while (!state->done)
+    {
+        zmq_msg_init(&msg);
+        int rc = recv_frame(*socket, &msg, OZZERO_DONTWAIT, interrupted);
+        if (rc <= 0)
+        {
+            int error_number = errno;
+            zmq_msg_close(&msg);
+            if (rc == 0)
+                break;
+            errno = error_number;
+            return raise_error();
+        }
+
+        rc = state->consume(&msg, socket->has_more());
+        int error_number = errno;
+        zmq_msg_close(&msg);
+        if (rc < 0)
+        {
+            errno = error_number;
+            return raise_error();
+        }
+    }
+
+    OZ_out(0) = state->done ? OZ_true() : OZ_false();
+    OZ_out(1) = interrupted ? OZ_true() : OZ_false();
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+/** {ZN.sinkClose +FileSink ?TotalI ?Crc32I} */
+OZ_BI_define(ozzero_sink_close, 1, 2)
+{
+    OZ_declare(FileSink, 0, sink);
+    ENSURE_VALID(FileSink, sink);
+
+    FileSinkState* state = sink->_obj;
+    sink->_obj = NULL;
+    int rc = state->close();
+    OZ_out(0) = OZ_uint64(state->total);
+    OZ_out(1) = OZ_uint64(state->crc);
+    delete state;
+    return checked(rc);
+}
+OZ_BI_end
+
+//}}}
+//------------------------------------------------------------------------------
+//{{{ Asynchronous RPC client
+
+/** Copy 'size' bytes into a new frame and send it through 'socket'. The return
+value is like zmq_msg_send. */
+static int send_copy(Socket& socket, const void* data, size_t size, int flags)
+{
+    zmq_msg_t msg;
+    if (zmq_msg_init_size(&msg, size) != 0)
+        return -1;
+    if (size > 0)
+        memcpy(zmq_msg_data(&msg), data, size);
+
+    int rc = socket.encode(&msg);
+    if (rc >= 0)
+        rc = socket.send_raw(&msg, flags);
+    int error_number = errno;
+    zmq_msg_close(&msg);
+    errno = error_number;
+    return rc;
+}
+
+/** Requests in flight on a DEALER socket. Each request is sent as a
+correlation id frame, an empty delimiter and the payload frames, so it can go
+through ROUTER/REP peers, which echo the envelope back with the reply. */
+struct RpcClientState
+{
+    struct Pending
+    {
+        /** The protected Oz variable to bind to the reply. */
+        OZ_Term* result;
+        bool single;
+        std::multimap<uint64_t, uint64_t>::iterator deadline;
+    };
+
+    uint64_t next_id;
+    std::tr1::unordered_map<uint64_t, Pending> pending;
+    /** Deadline (monotonic ns) to request id, ordered by deadline. */
+    std::multimap<uint64_t, uint64_t> deadlines;
+
+    RpcClientState() : next_id(1) {}
+
+    void add(uint64_t id, OZ_Term result, bool single, long timeout_ms)
+    {
+        Pending entry;
+        entry.result = new OZ_Term(result);
+        OZ_protect(entry.result);
+        entry.single = single;
+        uint64_t deadline = timeout_ms < 0 ? ~0ULL : monotonic_ns() + timeout_ms * 1000000ULL;
+        entry.deadline = deadlines.insert(std::make_pair(deadline, id));
+        pending.insert(std::make_pair(id, entry));
+    }
+
+    /** Remove the request 'id' and return its Oz variable. */
+    OZ_Term take(std::tr1::unordered_map<uint64_t, Pending>::iterator it)
+    {
+        OZ_Term result = *it->second.result;
+        OZ_unprotect(it->second.result);
+        delete it->second.result;
+        deadlines.erase(it->second.deadline);
+        pending.erase(it);
+        return result;
+    }
+};
+
+int g_id_RpcClient;
+class RpcClient : public Extension<RpcClient, RpcClientState*, g_id_RpcClient>
+{
+public:
+    explicit RpcClient(RpcClientState* obj) : Extension(obj) {}
+
+    bool is_valid() const { return _obj != NULL; }
+
+    virtual OZ_Term printV(int depth)
+    {
+        return OZ_mkTupleC("#", 3,
+                           OZ_atom("<Z14.RpcClient "),
+                           OZ_int(_obj ? _obj->pending.size() : 0),
+                           OZ_atom(" pending>"));
+    }
+};
+
+/** {ZN.rpcNew ?RpcClient} */
+OZ_BI_define(ozzero_rpc_new, 0, 1)
+{
+    OZ_RETURN(OZ_extension(new RpcClient(new RpcClientState())));
+}
+OZ_BI_end
+
+/** {ZN.rpcCall +RpcClient +Socket +PayloadBSL +Single +Result +TimeoutI
+                ?Completed ?Interrupted}
+
+Send a request without waiting. Once it is sent, 'Result' is remembered and
+later bound by rpcPump to the list of reply frames, or only the first of them if
+'Single' is true. A negative timeout means forever.
+*/
+OZ_BI_define(ozzero_rpc_call, 6, 2)
+{
+    OZ_declare(RpcClient, 0, client);
+    ENSURE_VALID(RpcClient, client);
+    OZ_declare(Socket, 1, socket);
+    ENSURE_VALID(Socket, socket);
+    OZ_declareDetTerm(2, payload_term);
+    OZ_declareDetTerm(3, single_term);
+    OZ_Term result = OZ_in(4);
+    OZ_declareLong(5, timeout);
+
+    std::vector<ByteString*> payload;
+    for (OZ_Term it = payload_term; OZ_isCons(it); it = OZ_tail(it))
+    {
+        OZ_Term head = OZ_deref(OZ_head(it));
+        if (!OZ_isByteString(head))
+            return OZ_typeError(2, "list of ByteStrings");
+        payload.push_back(tagged2ByteString(head));
+    }
+    if (payload.empty())
+        return OZ_typeError(2, "nonempty list of ByteStrings");
+
+    RpcClientState* state = client->_obj;
+    uint64_t id = state->next_id;
+
+    OZ_out(0) = OZ_false();
+    OZ_out(1) = OZ_false();
+    if (send_copy(*socket, &id, sizeof(id), OZZERO_DONTWAIT | ZMQ_SNDMORE) < 0)
+    {
+        if (errno == EAGAIN)
+            return OZ_ENTAILED;
+        if (errno == EINTR && !am.isSetSFlag(SigPending))
+        {
+            OZ_out(1) = OZ_true();
+            return OZ_ENTAILED;
+        }
+        return raise_error();
+    }
+
+    // The rest of a multipart message is accepted once the first part is.
+    if (send_copy(*socket, NULL, 0, ZMQ_SNDMORE) < 0)
+        return raise_error();
+    for (size_t i = 0; i < payload.size(); ++ i)
+    {
+        int flags = i + 1 < payload.size() ? ZMQ_SNDMORE : 0;
+        if (send_copy(*socket, payload[i]->getData(), payload[i]->getSize(), flags) < 0)
+            return raise_error();
+    }
+
+    ++ state->next_id;
+    state->add(id, result, OZ_isTrue(single_term), timeout);
+    OZ_out(0) = OZ_true();
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+/** {ZN.rpcPump +RpcClient +Socket ?ResultsL ?NextDeadlineI ?Interrupted}
+
+Receive every reply available without blocking, and expire requests which have
+timed out. 'ResultsL' contains 'reply(Result Value)', 'timeout(Result)' and
+'failed(Result CodeA MessageA)' for the caller to bind. Replies to unknown or
+expired requests are dropped. When receiving fails, the replies received so far
+are still returned, and every request in flight fails with that error.
+'NextDeadlineI' is how many milliseconds the pump may wait for replies before a
+request times out: negative for forever, and also when nothing is in flight, in
+which case 'ResultsL' is nil unless the client is closed. A closed client has
+nothing to pump.
+*/
+OZ_BI_define(ozzero_rpc_pump, 2, 3)
+{
+    OZ_declare(RpcClient, 0, client);
+    OZ_declare(Socket, 1, socket);
+    ENSURE_VALID(Socket, socket);
+
+    RpcClientState* state = client->_obj;
+    if (state == NULL)
+    {
+        // The pump may race with closing the client.
+        OZ_out(0) = OZ_nil();
+        OZ_out(1) = OZ_int(-1);
+        OZ_out(2) = OZ_false();
+        return OZ_ENTAILED;
+    }
+
+    std::vector<OZ_Term> results;
+    std::vector<OZ_Term> frames;
+    bool interrupted = false;
+    int error_number = 0;
+
+    while (!interrupted && error_number == 0)
+    {
+        zmq_msg_t msg;
+        zmq_msg_init(&msg);
+        int rc = recv_frame(*socket, &msg, OZZERO_DONTWAIT, interrupted);
+        if (rc <= 0)
+        {
+            if (rc < 0)
+            {
+                error_number = errno;
+                skip_rest_of_message(*socket);
+            }
+            zmq_msg_close(&msg);
+            break;
+        }
+
+        uint64_t id = 0;
+        bool valid_id = zmq_msg_size(&msg) == sizeof(id);
+        if (valid_id)
+            memcpy(&id, zmq_msg_data(&msg), sizeof(id));
+        zmq_msg_close(&msg);
+
+        // Collect the rest of the reply, skipping the empty delimiter.
+        frames.clear();
+        bool delimiter_seen = false;
+        while (socket->has_more())
+        {
+            zmq_msg_init(&msg);
+            // The rest of the reply is queued already, so just retry after a
+            // signal.
+            for (;;)
+            {
+                bool frame_interrupted = false;
+                rc = recv_frame(*socket, &msg, 0, frame_interrupted);
+                if (rc != 0 || !frame_interrupted)
+                    break;
+            }
+            if (rc <= 0)
+            {
+                error_number = rc < 0 ? errno : EAGAIN;
+                skip_rest_of_message(*socket);
+                zmq_msg_close(&msg);
+                break;
+            }
+            if (!delimiter_seen && zmq_msg_size(&msg) == 0)
+                delimiter_seen = true;
+            else
+                frames.push_back(OZ_mkByteString(static_cast<const char*>(zmq_msg_data(&msg)),
+                                                 zmq_msg_size(&msg)));
+            zmq_msg_close(&msg);
+        }
+
+        if (error_number != 0 || !valid_id)
+            continue;
+        std::tr1::unordered_map<uint64_t, RpcClientState::Pending>::iterator it = state->pending.find(id);
+        if (it == state->pending.end())
+            continue;
+
+        OZ_Term value;
+        if (!it->second.single)
+            value = OZ_toList(frames.size(), frames.data());
+        else
+            value = frames.empty() ? OZ_mkByteString("", 0) : frames[0];
+        results.push_back(OZ_mkTupleC("reply", 2, state->take(it), value));
+    }
+
+    // Nothing tells which request a broken reply was for, and the socket may
+    // not recover, so fail them all rather than let them wait for a timeout.
+    if (error_number != 0)
+    {
+        OZ_Term code = error_code(error_number);
+        OZ_Term message = OZ_atom(strerror(error_number));
+        while (!state->pending.empty())
+            results.push_back(OZ_mkTupleC("failed", 3, state->take(state->pending.begin()),
+                                          code, message));
+    }
+
+    uint64_t now = monotonic_ns();
+    while (!state->deadlines.empty() && state->deadlines.begin()->first <= now)
+    {
+        uint64_t id = state->deadlines.begin()->second;
+        results.push_back(OZ_mkTupleC("timeout", 1, state->take(state->pending.find(id))));
+    }
+
+    long next_deadline = -1;
+    if (!state->deadlines.empty() && state->deadlines.begin()->first != ~0ULL)
+        next_deadline = static_cast<long>(std::min<uint64_t>(
+            (state->deadlines.begin()->first - now + 999999) / 1000000, INT_MAX));
+
+    OZ_out(0) = OZ_toList(results.size(), results.data());
+    OZ_out(1) = OZ_long(next_deadline);
+    OZ_out(2) = interrupted ? OZ_true() : OZ_false();
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+/** {ZN.rpcPending +RpcClient ?PendingI} */
+OZ_BI_define(ozzero_rpc_pending, 1, 1)
+{
+    OZ_declare(RpcClient, 0, client);
+    OZ_RETURN_INT(client->is_valid() ? client->_obj->pending.size() : 0);
+}
+OZ_BI_end
+
+/** {ZN.rpcClose +RpcClient ?ResultsL}
+
+Forget all requests in flight, returning 'timeout(Result)' for each of them. */
+OZ_BI_define(ozzero_rpc_close, 1, 1)
+{
+    OZ_declare(RpcClient, 0, client);
+    ENSURE_VALID(RpcClient, client);
+
+    RpcClientState* state = client->_obj;
+    client->_obj = NULL;
+    std::vector<OZ_Term> results;
+    while (!state->pending.empty())
+        results.push_back(OZ_mkTupleC("timeout", 1, state->take(state->pending.begin())));
+    delete state;
+    OZ_RETURN(OZ_toList(results.size(), results.data()));
+}
+OZ_BI_end
+
+//}}}
+//------------------------------------------------------------------------------
+//{{{ Poll
+
+/** Convert the 'revents' of a poll item to a list of 'pollin', 'pollout' and
+'pollerr'. */
+static OZ_Term revents_to_list(short revents)
+{
+    size_t revents_count = 0;
+    OZ_Term revents_terms[3];
+    if (revents & ZMQ_POLLIN)
+        revents_terms[revents_count++] = OZ_atom("pollin");
+    if (revents & ZMQ_POLLOUT)
+        revents_terms[revents_count++] = OZ_atom("pollout");
+    if (revents & ZMQ_POLLERR)
+        revents_terms[revents_count++] = OZ_atom("pollerr");
+    return OZ_toList(revents_count, revents_terms);
+}
+
+/** Ask 'item' for the 'wanted' events, except for pollout while the rate
+limits of 'socket' hold its next message back: ZMQ_EVENTS would report it
+writable, and a send would only fail. Returns in how many nanoseconds it may
+send again, 0 if it is not held back. */
+static uint64_t hold_back_paced(zmq_pollitem_t& item, short wanted, SocketState& socket)
+{
+    item.events = wanted;
+    if (!(wanted & ZMQ_POLLOUT))
+        return 0;
+    uint64_t delay = socket.pacer.delay();
+    if (delay > 0)
+        item.events &= ~ZMQ_POLLOUT;
+    return delay;
+}
+
+/** The zmq_poll timeout for what is left of 'timeout' after 'elapsed_ms',
+shortened to wake up once a socket held back for 'paced_ns' may send again. */
+static long paced_poll_timeout(long timeout, uint64_t elapsed_ms, uint64_t paced_ns)
+{
+    if (paced_ns == 0)
+        return timeout;
+    long elapsed = static_cast<long>(std::min<uint64_t>(elapsed_ms, INT_MAX)) * OZZERO_POLL_MSEC;
+    long remaining = timeout < 0 ? -1 : std::max(timeout - elapsed, 0L);
+    long paced = static_cast<long>(std::min<uint64_t>((paced_ns + 999999) / 1000000, INT_MAX))
+               * OZZERO_POLL_MSEC;
+    return remaining >= 0 && remaining <= paced ? remaining : paced;
+}
+
+/** {ZN.poll
+        ['#'(+Socket +EventsL Action) ...]
+        +Timeout
+        ?Completed
+        ['#'(?Socket ?EventsL Action) ...]
+        ?InterruptedNewTimeout} */
+OZ_BI_define(ozzero_poll, 2, 3)
+{
+    OZ_declareDetTerm(0, poll_items_term);
+    OZ_declareLong(1, timeout);
+
+    OZ_Term socket_atom = OZ_atom("socket");
+    OZ_Term events_atom = OZ_atom("events");
+    OZ_Term action_atom = OZ_atom("action");
+
+    std::vector<zmq_pollitem_t> poll_items;
+    std::vector<short> wanted_events;
+    std::vector<Socket*> sockets;
+    std::vector<OZ_Term> actions;
+
+    while (OZ_isCons(poll_items_term))
+    {
+        OZ_Term poll_item_term = OZ_head(poll_items_term);
+        if (!OZ_isTuple(poll_item_term) || OZ_width(poll_item_term) != 3)
+            return OZ_typeError(0, "list of 3-tuples");
+
+        OZ_Term socket_term = OZ_getArg(poll_item_term, 0);
+        OZ_Term events_term = OZ_getArg(poll_item_term, 1);
+        OZ_Term action_term = OZ_getArg(poll_item_term, 2);
+
+        Socket* socket = Socket::coerce(socket_term);
+        ENSURE_VALID(Socket, socket);
+        short events;
+        PARSE_FLAGS(g_atom_decoder.poll_events_map, "'pollin' or 'pollout'",
+                    0, events_term, events);
+
+        zmq_pollitem_t poll_item;
+        poll_item.socket = socket->handle();
+        poll_item.fd = 0;
+        poll_item.events = events;
+        poll_items.push_back(poll_item);
+        wanted_events.push_back(events);
+        sockets.push_back(socket);
+
+        actions.push_back(action_term);
+
+        poll_items_term = OZ_tail(poll_items_term);
+    }
+
+    int result_count;
+
+    size_t poll_items_count = poll_items.size();
+
+    bool is_eintr = false;
+    timespec start_time;
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    uint64_t start_ms = monotonic_ms();
+    for (;;)
+    {
+        // Poll paced sockets without their pollout, at most until the first of
+        // them may send again, and look again then.
+        uint64_t paced_ns = 0;
+        for (size_t i = 0; i < poll_items_count; ++ i)
+        {
+            uint64_t delay = hold_back_paced(poll_items[i], wanted_events[i], sockets[i]->state());
+            if (delay > 0)
+                paced_ns = paced_ns == 0 ? delay : std::min(paced_ns, delay);
+        }
+        long poll_timeout = paced_poll_timeout(timeout, monotonic_ms() - start_ms, paced_ns);
+
+        TRAPPING_SIGALRM(is_eintr,
+            result_count = traced_poll(poll_items.data(), poll_items_count, poll_timeout)
+        );
+        if (is_eintr || result_count != 0 || poll_timeout == timeout || poll_timeout == 0)
+            break;
+    }
+    if (!is_eintr)
+    {
+        OZ_out(2) = OZ_unit();
+    }
+    else
+    {
+        if (timeout > 0)
+        {
+            timespec end_time;
+            clock_gettime(CLOCK_MONOTONIC, &end_time);
+            long time_elapsed = (end_time.tv_sec - start_time.tv_sec) * 1000;
+            time_elapsed += (end_time.tv_nsec - start_time.tv_nsec) / 1000000;
+            OZ_out(2) = OZ_long(timeout - time_elapsed);
+        }
+        else
+        {
+            OZ_out(2) = OZ_long(timeout);
+        }
+    }
+    OZ_out(0) = (result_count == 0) ? OZ_false() : OZ_true();
+
+    if (result_count <= 0)
+    {
+        OZ_out(1) = OZ_nil();
+    }
+    else
+    {
+        std::vector<OZ_Term> result_terms;
+        result_terms.reserve(result_count);
+        for (size_t i = 0; i < poll_items_count; ++ i)
+        {
+            short revents = poll_items[i].revents;
+            if (revents == 0)
+                continue;
+
+            // Spooled frames go out first, as soon as the socket is writable.
+            if ((revents & ZMQ_POLLOUT) && sockets[i]->drain_spool() < 0)
+                return raise_error();
+
+            result_terms.push_back(OZ_pair2(revents_to_list(revents), actions[i]));
+        }
+        OZ_out(1) = OZ_toList(result_terms.size(), result_terms.data());
+    }
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+//}}}
+//------------------------------------------------------------------------------
+//{{{ Scalable poller
+
+/** A socket registered in a poller. */
+struct PollerWatch
+{
+    PollerState* poller;
+    SocketState* socket;
+    int id;
+    short events;
+    int fd;
+    /** Whether the watch is in the poller's recheck list. */
+    bool pending;
+    /** The last wait which reported this socket ready. */
+    unsigned round;
+};
+
+/** Sockets watched through their ZMQ_FD. On Linux the descriptors are added to
+an epoll set once, and a wait only looks at ZMQ_EVENTS of the sockets whose
+descriptor fired, plus those in the recheck list, so it costs in proportion to
+the ready sockets rather than the registered ones. Elsewhere it falls back to
+zmq_poll over all of them.
+
+ZMQ_FD only signals that ZMQ_EVENTS may have changed, and any libzmq call on
+the socket may swallow that signal. So a socket goes back into the recheck list
+when it was reported ready, and whenever it is used (see SocketState::touch). */
+struct PollerState
+{
+    int epoll_fd;
+    int next_id;
+    unsigned round;
+    std::tr1::unordered_map<int, PollerWatch*> watches;
+    std::vector<PollerWatch*> pending;
+
+    /** Sockets whose pollout the current wait holds back for their rate
+    limits, and when the first of them may send again. */
+    std::vector<PollerWatch*> paced;
+    uint64_t paced_until_ns;
+
+    PollerState() : epoll_fd(-1), next_id(1), round(0), paced_until_ns(0) {}
+
+    ~PollerState()
+    {
+        typedef std::tr1::unordered_map<int, PollerWatch*>::iterator Iterator;
+        for (Iterator it = watches.begin(); it != watches.end(); ++ it)
+        {
+            std::vector<PollerWatch*>& socket_watches = it->second->socket->watches;
+            socket_watches.erase(std::find(socket_watches.begin(), socket_watches.end(), it->second));
+            delete it->second;
+        }
+        if (epoll_fd >= 0)
+            ::close(epoll_fd);
+    }
+
+    int open()
+    {
+    #ifdef __linux__
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        return epoll_fd < 0 ? -1 : 0;
+    #else
+        return 0;
+    #endif
+    }
+
+    void mark_pending(PollerWatch* watch)
+    {
+        if (!watch->pending)
+        {
+            watch->pending = true;
+            pending.push_back(watch);
+        }
+    }
+
+    int add(SocketState* socket, short events)
+    {
+        int fd;
+        size_t length = sizeof(fd);
+        if (zmq_getsockopt(socket->handle, ZMQ_FD, &fd, &length) != 0)
+            return -1;
+
+        PollerWatch* watch = new PollerWatch;
+        watch->poller = this;
+        watch->socket = socket;
+        watch->id = next_id++;
+        watch->events = events;
+        watch->fd = fd;
+        watch->pending = false;
+        watch->round = round;
+
+    #ifdef __linux__
+        epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = watch;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+        {
+            delete watch;
+            return -1;
+        }
+    #endif
+
+        watches.insert(std::make_pair(watch->id, watch));
+        socket->watches.push_back(watch);
+        // The socket may already be ready, and its descriptor won't tell.
+        mark_pending(watch);
+        return watch->id;
+    }
+
+    /** Forget a watch. The socket must still be open. */
+    void remove(PollerWatch* watch)
+    {
+    #ifdef __linux__
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+    #endif
+        if (watch->pending)
+            pending.erase(std::find(pending.begin(), pending.end(), watch));
+        watches.erase(watch->id);
+        delete watch;
+    }
+
+    bool remove(int id)
+    {
+        std::tr1::unordered_map<int, PollerWatch*>::iterator it = watches.find(id);
+        if (it == watches.end())
+            return false;
+        PollerWatch* watch = it->second;
+        std::vector<PollerWatch*>& socket_watches = watch->socket->watches;
+        socket_watches.erase(std::find(socket_watches.begin(), socket_watches.end(), watch));
+        remove(watch);
+        return true;
+    }
+
+    /** Append the watch to 'ready' if ZMQ_EVENTS says so and it is not there
+    already. A socket found not ready is checked again whenever its descriptor
+    fires, even within the same wait: reading ZMQ_EVENTS is what clears it. */
+    int check(PollerWatch* watch, std::vector<std::pair<PollerWatch*, short> >& ready)
+    {
+        if (watch->round == round)
+            return 0;
+
+    #if ZMQ_VERSION >= 30100
+        int events = 0;
+    #else
+        uint32_t events = 0;
+    #endif
+        size_t length = sizeof(events);
+        if (zmq_getsockopt(watch->socket->handle, ZMQ_EVENTS, &events, &length) != 0)
+            return -1;
+        short revents = static_cast<short>(events) & watch->events;
+        if (revents & ZMQ_POLLOUT)
+        {
+            uint64_t delay = watch->socket->pacer.delay();
+            if (delay > 0)
+            {
+                revents &= ~ZMQ_POLLOUT;
+                if (std::find(paced.begin(), paced.end(), watch) == paced.end())
+                    paced.push_back(watch);
+                uint64_t until = monotonic_ns() + delay;
+                if (paced_until_ns == 0 || until < paced_until_ns)
+                    paced_until_ns = until;
+            }
+        }
+        if (revents != 0)
+        {
+            watch->round = round;
+            ready.push_back(std::make_pair(watch, revents));
+        }
+        return 0;
+    }
+
+    /** Check the sockets held back for their rate limits again, once the
+    first of them may send. */
+    int check_paced(std::vector<std::pair<PollerWatch*, short> >& ready)
+    {
+        if (paced.empty() || monotonic_ns() < paced_until_ns)
+            return 0;
+        std::vector<PollerWatch*> again;
+        again.swap(paced);
+        paced_until_ns = 0;
+        for (size_t i = 0; i < again.size(); ++ i)
+        {
+            if (check(again[i], ready) != 0)
+            {
+                paced.insert(paced.end(), again.begin() + i, again.end());
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    /** Put the sockets held back for their rate limits into the recheck list,
+    for the next wait. */
+    void end_wait()
+    {
+        for (size_t i = 0; i < paced.size(); ++ i)
+            mark_pending(paced[i]);
+        paced.clear();
+        paced_until_ns = 0;
+    }
+
+    /** Put the sockets back into the recheck list after a failed wait. */
+    int fail(const std::vector<PollerWatch*>& recheck)
+    {
+        int error_number = errno;
+        for (size_t i = 0; i < recheck.size(); ++ i)
+            mark_pending(recheck[i]);
+        end_wait();
+        errno = error_number;
+        return -1;
+    }
+
+    /** Wait at most 'timeout' milliseconds (forever if negative) for some
+    sockets to be ready. Returns -1 with errno set on error, including EINTR. */
+    int wait(long timeout, std::vector<std::pair<PollerWatch*, short> >& ready)
+    {
+        ++ round;
+        std::vector<PollerWatch*> recheck;
+        recheck.swap(pending);
+        for (size_t i = 0; i < recheck.size(); ++ i)
+        {
+            recheck[i]->pending = false;
+            if (check(recheck[i], ready) != 0)
+                return fail(recheck);
+        }
+
+    #ifdef __linux__
+        uint64_t deadline = timeout < 0 ? ~0ULL : monotonic_ms() + timeout;
+        epoll_event events[256];
+        for (;;)
+        {
+            if (ready.empty() && check_paced(ready) != 0)
+                return fail(recheck);
+
+            long wait_time = 0;
+            if (ready.empty() && timeout != 0)
+            {
+                uint64_t now = monotonic_ms();
+                if (deadline == ~0ULL)
+                    wait_time = -1;
+                else if (deadline > now)
+                    wait_time = static_cast<long>(std::min<uint64_t>(deadline - now, INT_MAX));
+            }
+
+            // Wake up when a paced socket may send again.
+            if (wait_time != 0 && !paced.empty())
+            {
+                uint64_t now_ns = monotonic_ns();
+                long until_paced = paced_until_ns <= now_ns ? 1
+                    : static_cast<long>(std::min<uint64_t>((paced_until_ns - now_ns + 999999) / 1000000, INT_MAX));
+                if (wait_time < 0 || until_paced < wait_time)
+                    wait_time = until_paced;
+            }
+
+            int count;
+            TRACED(TRACE_POLL, NULL, count,
+                   epoll_wait(epoll_fd, events, sizeof(events) / sizeof(*events),
+                              static_cast<int>(wait_time)));
+            if (count < 0)
+            {
+                if (errno == EINTR && !ready.empty())
+                    break;
+                return fail(recheck);
+            }
+
+            for (int i = 0; i < count; ++ i)
+            {
+                PollerWatch* watch = static_cast<PollerWatch*>(events[i].data.ptr);
+                if (check(watch, ready) != 0)
+                    return fail(recheck);
+            }
+
+            // A descriptor may fire without the socket becoming ready.
+            if (!ready.empty() || wait_time == 0)
+                break;
+        }
+    #else
+        if (ready.empty())
+        {
+            std::vector<zmq_pollitem_t> poll_items;
+            std::vector<PollerWatch*> poll_watches;
+            typedef std::tr1::unordered_map<int, PollerWatch*>::iterator Iterator;
+            for (Iterator it = watches.begin(); it != watches.end(); ++ it)
+            {
+                zmq_pollitem_t poll_item;
+                poll_item.socket = it->second->socket->handle;
+                poll_item.fd = 0;
+                poll_item.events = it->second->events;
+                poll_item.revents = 0;
+                poll_items.push_back(poll_item);
+                poll_watches.push_back(it->second);
+            }
+
+            long full_timeout = timeout > 0 ? timeout * OZZERO_POLL_MSEC : timeout;
+            uint64_t start_ms = monotonic_ms();
+            for (;;)
+            {
+                uint64_t paced_ns = 0;
+                for (size_t i = 0; i < poll_items.size(); ++ i)
+                {
+                    uint64_t delay = hold_back_paced(poll_items[i], poll_watches[i]->events,
+                                                     *poll_watches[i]->socket);
+                    if (delay > 0)
+                        paced_ns = paced_ns == 0 ? delay : std::min(paced_ns, delay);
+                }
+                long poll_timeout = paced_poll_timeout(full_timeout, monotonic_ms() - start_ms, paced_ns);
+                int count = traced_poll(poll_items.data(), poll_items.size(), poll_timeout);
+                if (count < 0)
+                    return fail(recheck);
+                if (count != 0 || poll_timeout == full_timeout || poll_timeout == 0)
+                    break;
+            }
+            for (size_t i = 0; i < poll_items.size(); ++ i)
+            {
+                if (poll_items[i].revents != 0)
+                    ready.push_back(std::make_pair(poll_watches[i], poll_items[i].revents));
+            }
+        }
+    #endif
+
+        // Report them again next time unless they stop being ready.
+        for (size_t i = 0; i < ready.size(); ++ i)
+            mark_pending(ready[i].first);
+        end_wait();
+        return static_cast<int>(ready.size());
+    }
+};
+
+static void poller_socket_touched(PollerWatch* watch)
+{
+    watch->poller->mark_pending(watch);
+}
+
+static void poller_socket_closed(PollerWatch* watch)
+{
+    watch->poller->remove(watch);
+}
+
+int g_id_Poller;
+class Poller : public Extension<Poller, PollerState*, g_id_Poller>
+{
+public:
+    explicit Poller(PollerState* obj) : Extension(obj) {}
+
+    bool is_valid() const { return _obj != NULL; }
+
+    virtual OZ_Term printV(int depth)
+    {
+        return OZ_mkTupleC("#", 3,
+                           OZ_atom("<Z14.Poller "),
+                           OZ_unsignedLong(reinterpret_cast<uintptr_t>(_obj)),
+                           OZ_atom(">"));
+    }
+};
+
+/** {ZN.pollerNew ?Poller} */
+OZ_BI_define(ozzero_poller_new, 0, 1)
+{
+    PollerState* state = new PollerState();
+    if (state->open() != 0)
+    {
+        int error_number = errno;
+        delete state;
+        errno = error_number;
+        return raise_error();
+    }
+    OZ_RETURN(OZ_extension(new Poller(state)));
+}
+OZ_BI_end
+
+/** {ZN.pollerClose +Poller} */
+OZ_BI_define(ozzero_poller_close, 1, 0)
+{
+    OZ_declare(Poller, 0, poller);
+    delete poller->_obj;
+    poller->_obj = NULL;
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+/** {ZN.pollerAdd +Poller +Socket +EventsL ?IdI}
+
+Closing the socket removes it from the poller.
+*/
+OZ_BI_define(ozzero_poller_add, 3, 1)
+{
+    OZ_declare(Poller, 0, poller);
+    ENSURE_VALID(Poller, poller);
+    OZ_declare(Socket, 1, socket);
+    ENSURE_VALID(Socket, socket);
+    OZ_declareDetTerm(2, events_term);
+
+    short events;
+    PARSE_FLAGS(g_atom_decoder.poll_events_map, "'pollin' or 'pollout'",
+                2, events_term, events);
+
+    int id = poller->_obj->add(&socket->state(), events);
+    if (id < 0)
+        return raise_error();
+    OZ_RETURN_INT(id);
+}
+OZ_BI_end
+
+/** {ZN.pollerRemove +Poller +IdI ?Removed} */
+OZ_BI_define(ozzero_poller_remove, 2, 1)
+{
+    OZ_declare(Poller, 0, poller);
+    ENSURE_VALID(Poller, poller);
+    OZ_declareInt(1, id);
+    OZ_RETURN(poller->_obj->remove(id) ? OZ_true() : OZ_false());
+}
+OZ_BI_end
+
+/** What is left of 'max_wait' milliseconds (negative meaning forever) which
+started at 'start_ms', for retrying an interrupted wait; unit if the wait was
+not interrupted. */
+static OZ_Term remaining_wait(bool is_eintr, long max_wait, uint64_t start_ms)
+{
+    if (!is_eintr)
+        return OZ_unit();
+    if (max_wait <= 0)
+        return OZ_long(max_wait);
+    uint64_t elapsed = monotonic_ms() - start_ms;
+    return OZ_long(elapsed >= static_cast<uint64_t>(max_wait) ? 0 : max_wait - static_cast<long>(elapsed));
+}
+
+/** {ZN.pollerWait +Poller +MaxWaitI ?ReadyL ?NewMaxWait}
+
+Wait, at most 'MaxWaitI' milliseconds (forever if negative), until some of the
+registered sockets are ready. 'ReadyL' is a list of 'IdI#ReventsL'. A socket
+stays in the list as long as it is ready, like with zmq_poll. 'NewMaxWait' is
+unit, or the time left to wait again with if the wait was interrupted.
+*/
+OZ_BI_define(ozzero_poller_wait, 2, 2)
+{
+    OZ_declare(Poller, 0, poller);
+    ENSURE_VALID(Poller, poller);
+    OZ_declareLong(1, max_wait);
+
+    std::vector<std::pair<PollerWatch*, short> > ready;
+    bool is_eintr = false;
+    uint64_t start_ms = monotonic_ms();
+    TRAPPING_SIGALRM(is_eintr, poller->_obj->wait(max_wait, ready));
+
+    std::vector<OZ_Term> ready_terms;
+    for (size_t i = 0; i < ready.size(); ++ i)
+        ready_terms.push_back(OZ_pair2(OZ_int(ready[i].first->id),
+                                       revents_to_list(ready[i].second)));
+
+    OZ_out(0) = OZ_toList(ready_terms.size(), ready_terms.data());
+    OZ_out(1) = remaining_wait(is_eintr, max_wait, start_ms);
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+//}}}
+//------------------------------------------------------------------------------
+//{{{ Reactor
+
+/** A hierarchical timer wheel with a resolution of one millisecond. Level 0
+has a slot for each of the next 64 ticks, and each slot of level N covers 64
+slots of level N-1. Timers move down a level whenever the level below has made
+a full turn, so adding, cancelling and expiring a timer are all O(1). */
+class TimerWheel
+{
+public:
+    struct Timer
+    {
+        int id;
+        uint64_t expires;
+        uint64_t interval;
+        bool cancelled;
+    };
+
+private:
+    static const int LEVELS = 4;
+    static const int BITS = 6;
+    static const int SLOTS = 1 << BITS;
+    static const uint64_t MASK = SLOTS - 1;
+
+    /** The next tick to be processed. */
+    uint64_t _base;
+    std::vector<Timer*> _slots[LEVELS][SLOTS];
+    std::tr1::unordered_map<int, Timer*> _timers;
+
+    void insert(Timer* timer)
+    {
+        uint64_t expires = std::max(timer->expires, _base);
+        uint64_t delta = expires - _base;
+
+        int level = 0;
+        while (level < LEVELS - 1 && delta >= (1ULL << (BITS * (level + 1))))
+            ++ level;
+        // Timers beyond the range of the wheel wait in the last level, and are
+        // put back when that slot is cascaded.
+        if (delta >= (1ULL << (BITS * LEVELS)))
+            expires = _base + (1ULL << (BITS * LEVELS)) - 1;
+
+        _slots[level][(expires >> (BITS * level)) & MASK].push_back(timer);
+    }
+
+    /** Move the timers of the current slot of 'level' down the wheel. Returns
+    the index of that slot, which is 0 when the next level should cascade too. */
+    uint64_t cascade(int level)
+    {
+        uint64_t index = (_base >> (BITS * level)) & MASK;
+        std::vector<Timer*> timers;
+        timers.swap(_slots[level][index]);
+        for (size_t i = 0; i < timers.size(); ++ i)
+        {
+            if (timers[i]->cancelled)
+                delete timers[i];
+            else
+                insert(timers[i]);
+        }
+        return index;
+    }
+
+    void clear()
+    {
+        for (int level = 0; level < LEVELS; ++ level)
+        {
+            for (int slot = 0; slot < SLOTS; ++ slot)
+            {
+                std::vector<Timer*>& timers = _slots[level][slot];
+                for (size_t i = 0; i < timers.size(); ++ i)
+                    delete timers[i];
+                timers.clear();
+            }
+        }
+    }
+
+public:
+    explicit TimerWheel(uint64_t now) : _base(now) {}
+
+    ~TimerWheel()
+    {
+        clear();
+    }
+
+    bool empty() const { return _timers.empty(); }
+
+    void add(int id, uint64_t expires, uint64_t interval)
+    {
+        Timer* timer = new Timer;
+        timer->id = id;
+        timer->expires = expires;
+        timer->interval = interval;
+        timer->cancelled = false;
+        _timers.insert(std::make_pair(id, timer));
+        insert(timer);
+    }
+
+    /** Cancel a timer. The entry stays in its slot until the wheel reaches it. */
+    bool cancel(int id)
+    {
+        std::tr1::unordered_map<int, Timer*>::iterator it = _timers.find(id);
+        if (it == _timers.end())
+            return false;
+        it->second->cancelled = true;
+        _timers.erase(it);
+        return true;
+    }
+
+    /** Process every tick up to 'now', appending the ids of expired timers.
+    Repeating timers are rescheduled. */
+    void advance(uint64_t now, std::vector<int>& expired)
+    {
+        if (_timers.empty())
+        {
+            // Only cancelled entries are left; no need to walk through them.
+            clear();
+            _base = std::max(_base, now + 1);
+            return;
+        }
+
+        while (_base <= now)
+        {
+            uint64_t index = _base & MASK;
+            if (index != 0 && _slots[0][index].empty())
+            {
+                // Nothing happens until the next event; skip the idle ticks.
+                _base = std::min(next_event(), now + 1);
+                continue;
+            }
+            for (int level = 1; index == 0 && level < LEVELS; ++ level)
+                index = cascade(level);
+
+            std::vector<Timer*> timers;
+            timers.swap(_slots[0][_base & MASK]);
+            for (size_t i = 0; i < timers.size(); ++ i)
+            {
+                Timer* timer = timers[i];
+                if (timer->cancelled)
+                {
+                    delete timer;
+                    continue;
+                }
+
+                expired.push_back(timer->id);
+                if (timer->interval > 0)
+                {
+                    // Periods missed while nobody was waiting are skipped, not
+                    // replayed back to back.
+                    timer->expires = std::max(timer->expires + timer->interval, now + 1);
+                    insert(timer);
+                }
+                else
+                {
+                    _timers.erase(timer->id);
+                    delete timer;
+                }
+            }
+            ++ _base;
+        }
+    }
+
+    /** The earliest tick at which 'advance' may have something to do, or
+    ~0 if there are no timers. Timers in levels above 0 count from the tick at
+    which they move down, which is never later than when they expire. */
+    uint64_t next_event() const
+    {
+        uint64_t earliest = ~0ULL;
+        if (_timers.empty())
+            return earliest;
+
+        for (int level = 0; level < LEVELS; ++ level)
+        {
+            int shift = BITS * level;
+            uint64_t block = _base >> shift;
+            // The current slot of a level is still pending only if the next
+            // tick is the one to cascade it.
+            bool at_boundary = (_base & ((1ULL << shift) - 1)) == 0;
+            for (uint64_t j = at_boundary ? 0 : 1; j <= SLOTS; ++ j)
+            {
+                if (!_slots[level][(block + j) & MASK].empty())
+                {
+                    uint64_t tick = level == 0 ? _base + j : (block + j) << shift;
+                    earliest = std::min(earliest, tick);
+                    break;
+                }
+            }
+        }
+        return earliest;
+    }
+};
+
+/** Registered sockets and timers of a reactor. The sockets are watched by a
+scalable poller, and timers take their ids from the same counter. */
+struct ReactorState
+{
+    PollerState poller;
+    TimerWheel timers;
+
+    ReactorState() : timers(monotonic_ms()) {}
+};
+
+int g_id_Reactor;
+class Reactor : public Extension<Reactor, ReactorState*, g_id_Reactor>
+{
+public:
+    explicit Reactor(ReactorState* obj) : Extension(obj) {}
+
+    bool is_valid() const { return _obj != NULL; }
+
+    virtual OZ_Term printV(int depth)
+    {
+        return OZ_mkTupleC("#", 3,
+                           OZ_atom("<Z14.Reactor "),
+                           OZ_unsignedLong(reinterpret_cast<uintptr_t>(_obj)),
+                           OZ_atom(">"));
+    }
+};
+
+/** {ZN.reactorNew ?Reactor} */
+OZ_BI_define(ozzero_reactor_new, 0, 1)
+{
+    ReactorState* state = new ReactorState();
+    if (state->poller.open() != 0)
+    {
+        int error_number = errno;
+        delete state;
+        errno = error_number;
+        return raise_error();
+    }
+    OZ_RETURN(OZ_extension(new Reactor(state)));
+}
+OZ_BI_end
+
+/** {ZN.reactorClose +Reactor} */
+OZ_BI_define(ozzero_reactor_close, 1, 0)
+{
+    OZ_declare(Reactor, 0, reactor);
+    delete reactor->_obj;
+    reactor->_obj = NULL;
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+/** {ZN.reactorAddSocket +Reactor +Socket +EventsL ?IdI} */
+OZ_BI_define(ozzero_reactor_add_socket, 3, 1)
+{
+    OZ_declare(Reactor, 0, reactor);
+    ENSURE_VALID(Reactor, reactor);
+    OZ_declare(Socket, 1, socket);
+    ENSURE_VALID(Socket, socket);
+    OZ_declareDetTerm(2, events_term);
+
+    short events;
+    PARSE_FLAGS(g_atom_decoder.poll_events_map, "'pollin' or 'pollout'",
+                2, events_term, events);
+
+    int id = reactor->_obj->poller.add(&socket->state(), events);
+    if (id < 0)
+        return raise_error();
+    OZ_RETURN_INT(id);
+}
+OZ_BI_end
+
+/** {ZN.reactorAddTimer +Reactor +DelayI +IntervalI ?IdI}
+
+The timer first fires after 'DelayI' milliseconds, then every 'IntervalI'
+milliseconds if that is positive.
+*/
+OZ_BI_define(ozzero_reactor_add_timer, 3, 1)
+{
+    OZ_declare(Reactor, 0, reactor);
+    ENSURE_VALID(Reactor, reactor);
+    OZ_declareLong(1, delay);
+    OZ_declareLong(2, interval);
+
+    ReactorState* state = reactor->_obj;
+    int id = state->poller.next_id++;
+    state->timers.add(id, monotonic_ms() + std::max(delay, 0L), std::max(interval, 0L));
+    OZ_RETURN_INT(id);
+}
+OZ_BI_end
+
+/** {ZN.reactorRemove +Reactor +IdI ?Removed} */
+OZ_BI_define(ozzero_reactor_remove, 2, 1)
+{
+    OZ_declare(Reactor, 0, reactor);
+    ENSURE_VALID(Reactor, reactor);
+    OZ_declareInt(1, id);
+
+    ReactorState* state = reactor->_obj;
+    bool removed = state->timers.cancel(id) || state->poller.remove(id);
+    OZ_RETURN(removed ? OZ_true() : OZ_false());
+}
+OZ_BI_end
+
+/** {ZN.reactorWait +Reactor +MaxWaitI ?EventsL ?NewMaxWait}
+
+Wait, at most 'MaxWaitI' milliseconds (forever if negative), until a socket is
+ready or a timer is due, in a single wait of its poller. 'EventsL' contains
+'socket(IdI ReventsL)' and 'timer(IdI)' for everything that happened. After an
+interruption, 'NewMaxWait' is what is left of 'MaxWaitI' to call it again with
+(the timers are accounted for every time); otherwise it is unit.
+*/
+OZ_BI_define(ozzero_reactor_wait, 2, 2)
+{
+    OZ_declare(Reactor, 0, reactor);
+    ENSURE_VALID(Reactor, reactor);
+    OZ_declareLong(1, max_wait);
+
+    ReactorState* state = reactor->_obj;
+    uint64_t now = monotonic_ms();
+    uint64_t next_event = state->timers.next_event();
+
+    long timeout = max_wait;
+    if (next_event != ~0ULL)
+    {
+        long until_timer = next_event <= now ? 0 : static_cast<long>(std::min<uint64_t>(next_event - now, INT_MAX));
+        if (timeout < 0 || until_timer < timeout)
+            timeout = until_timer;
+    }
+
+    std::vector<std::pair<PollerWatch*, short> > ready;
+    bool is_eintr = false;
+    TRAPPING_SIGALRM(is_eintr, state->poller.wait(timeout, ready));
+
+    std::vector<OZ_Term> event_terms;
+    for (size_t i = 0; i < ready.size(); ++ i)
+        event_terms.push_back(OZ_mkTupleC("socket", 2, OZ_int(ready[i].first->id),
+                                          revents_to_list(ready[i].second)));
+
+    std::vector<int> expired;
+    state->timers.advance(monotonic_ms(), expired);
+    for (size_t i = 0; i < expired.size(); ++ i)
+        event_terms.push_back(OZ_mkTupleC("timer", 1, OZ_int(expired[i])));
+
+    OZ_out(0) = OZ_toList(event_terms.size(), event_terms.data());
+    OZ_out(1) = remaining_wait(is_eintr, max_wait, now);
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+//}}}
+//------------------------------------------------------------------------------
+//{{{ Last value cache proxy
+
+#if ZMQ_VERSION >= 30101
+
+/** The latest message of every topic, in a prefix trie over the first frame,
+so that all topics matching a subscription are found without a scan. The
+oldest topics are evicted to keep within the limits. */
+class TopicTrie
+{
+    struct Node;
+
+    struct Entry
+    {
+        std::vector<zmq_msg_t*> frames;
+        size_t bytes;
+        std::list<Node*>::iterator age;
+    };
+
+    struct Node
+    {
+        Node* parent;
+        unsigned char key;
+        std::map<unsigned char, Node*> children;
+        Entry* entry;
+
+        Node(Node* parent_, unsigned char key_) : parent(parent_), key(key_), entry(NULL) {}
+    };
+
+    Node _root;
+    /** Nodes with an entry, least recently updated first. */
+    std::list<Node*> _ages;
+    size_t _topics;
+    size_t _bytes;
+    size_t _max_topics;
+    size_t _max_bytes;
+
+    static void free_frames(std::vector<zmq_msg_t*>& frames)
+    {
+        for (size_t i = 0; i < frames.size(); ++ i)
+        {
+            zmq_msg_close(frames[i]);
+            delete frames[i];
+        }
+        frames.clear();
+    }
+
+    void remove_entry(Node* node)
+    {
+        Entry* entry = node->entry;
+        _ages.erase(entry->age);
+        _bytes -= entry->bytes;
+        -- _topics;
+        free_frames(entry->frames);
+        delete entry;
+        node->entry = NULL;
+
+        // Prune the branch which no longer leads to any entry.
+        while (node != &_root && node->entry == NULL && node->children.empty())
+        {
+            Node* parent = node->parent;
+            parent->children.erase(node->key);
+            delete node;
+            node = parent;
+        }
+    }
+
+    static void free_node(Node* node)
+    {
+        for (std::map<unsigned char, Node*>::iterator it = node->children.begin();
+                it != node->children.end(); ++ it)
+        {
+            free_node(it->second);
+            delete it->second;
+        }
+        if (node->entry != NULL)
+        {
+            free_frames(node->entry->frames);
+            delete node->entry;
+        }
+    }
+
+    static void collect_node(const Node* node, std::vector<const std::vector<zmq_msg_t*>*>& result)
+    {
+        if (node->entry != NULL)
+            result.push_back(&node->entry->frames);
+        for (std::map<unsigned char, Node*>::const_iterator it = node->children.begin();
+                it != node->children.end(); ++ it)
+            collect_node(it->second, result);
+    }
+
+public:
+    size_t evictions;
+
+    TopicTrie(size_t max_topics, size_t max_bytes)
+        : _root(NULL, 0), _topics(0), _bytes(0),
+          _max_topics(max_topics), _max_bytes(max_bytes), evictions(0) {}
+
+    ~TopicTrie()
+    {
+        free_node(&_root);
+    }
+
+    size_t topics() const { return _topics; }
+    size_t bytes() const { return _bytes; }
+
+    /** Make 'frames' the latest message of its topic, taking ownership of
+    them. Messages larger than the byte limit are not cached at all. */
+    void store(std::vector<zmq_msg_t*>& frames)
+    {
+        size_t bytes = 0;
+        for (size_t i = 0; i < frames.size(); ++ i)
+            bytes += zmq_msg_size(frames[i]);
+        if (frames.empty() || (_max_bytes > 0 && bytes > _max_bytes))
+        {
+            free_frames(frames);
+            return;
+        }
+
+        const unsigned char* topic = static_cast<const unsigned char*>(zmq_msg_data(frames[0]));
+        size_t topic_size = zmq_msg_size(frames[0]);
+        Node* node = &_root;
+        for (size_t i = 0; i < topic_size; ++ i)
+        {
+            Node*& child = node->children[topic[i]];
+            if (child == NULL)
+                child = new Node(node, topic[i]);
+            node = child;
+        }
+
+        Entry* entry = node->entry;
+        if (entry == NULL)
+        {
+            entry = node->entry = new Entry;
+            entry->age = _ages.insert(_ages.end(), node);
+            ++ _topics;
+        }
+        else
+        {
+            free_frames(entry->frames);
+            _bytes -= entry->bytes;
+            _ages.splice(_ages.end(), _ages, entry->age);
+        }
+        entry->frames.swap(frames);
+        entry->bytes = bytes;
+        _bytes += bytes;
+
+        while ((_max_topics > 0 && _topics > _max_topics)
+                || (_max_bytes > 0 && _bytes > _max_bytes))
+        {
+            remove_entry(_ages.front());
+            ++ evictions;
+        }
+    }
+
+    /** Find the latest messages of all topics starting with 'prefix'. */
+    void collect(const unsigned char* prefix, size_t size,
+                 std::vector<const std::vector<zmq_msg_t*>*>& result) const
+    {
+        const Node* node = &_root;
+        for (size_t i = 0; i < size; ++ i)
+        {
+            std::map<unsigned char, Node*>::const_iterator it = node->children.find(prefix[i]);
+            if (it == node->children.end())
+                return;
+            node = it->second;
+        }
+        collect_node(node, result);
+    }
+};
+
+struct LvcStats
+{
+    uint64_t topics;
+    uint64_t bytes;
+    uint64_t forwarded;
+    uint64_t subscriptions;
+    uint64_t hits;
+    uint64_t replayed;
+    uint64_t evictions;
+};
+
+/** A proxy between an XSUB and an XPUB socket, running on its own thread.
+Messages are forwarded downstream as they are, and a copy, which shares the
+data of large frames, is kept as the latest value of its topic. When a
+subscription arrives, the cached messages matching it are published at once.
+
+The sockets belong to the proxy thread until it stops, when it closes them.
+It is controlled through a REP socket bound to an inproc endpoint. */
+struct LvcProxyState
+{
+    void* context;
+    std::string control_endpoint;
+    SocketState* frontend;
+    SocketState* backend;
+    pthread_t thread;
+    /** Cleared by the proxy thread when it exits. */
+    volatile int running;
+
+    TopicTrie cache;
+    LvcStats stats;
+
+    LvcProxyState(SocketState* frontend_, SocketState* backend_,
+                  size_t max_topics, size_t max_bytes)
+        : context(frontend_->context->handle), frontend(frontend_), backend(backend_),
+          running(0), cache(max_topics, max_bytes)
+    {
+        memset(&stats, 0, sizeof(stats));
+        char endpoint[64];
+        snprintf(endpoint, sizeof(endpoint), "inproc://ozzero-lvc-%p", static_cast<void*>(this));
+        control_endpoint = endpoint;
+    }
+
+    /** Receive all frames of a message. */
+    static int recv_message(void* socket, std::vector<zmq_msg_t*>& frames)
+    {
+        int more;
+        do
+        {
+            zmq_msg_t* msg = new zmq_msg_t;
+            zmq_msg_init(msg);
+            frames.push_back(msg);
+            if (zmq_msg_recv(msg, socket, 0) < 0)
+                return -1;
+            more = zmq_msg_more(msg);
+        }
+        while (more);
+        return 0;
+    }
+
+    /** Send copies of the frames, leaving them as they were. */
+    static int send_copies(void* socket, const std::vector<zmq_msg_t*>& frames)
+    {
+        for (size_t i = 0; i < frames.size(); ++ i)
+        {
+            zmq_msg_t copy;
+            zmq_msg_init(&copy);
+            zmq_msg_copy(&copy, frames[i]);
+            int rc = zmq_msg_send(&copy, socket, i + 1 < frames.size() ? ZMQ_SNDMORE : 0);
+            zmq_msg_close(&copy);
+            if (rc < 0)
+                return -1;
+        }
+        return 0;
+    }
+
+    int forward_publication()
+    {
+        std::vector<zmq_msg_t*> frames;
+        int rc = recv_message(frontend->handle, frames);
+        std::vector<zmq_msg_t*> cached;
+        for (size_t i = 0; rc >= 0 && i < frames.size(); ++ i)
+        {
+            zmq_msg_t* copy = new zmq_msg_t;
+            zmq_msg_init(copy);
+            zmq_msg_copy(copy, frames[i]);
+            cached.push_back(copy);
+            rc = zmq_msg_send(frames[i], backend->handle, i + 1 < frames.size() ? ZMQ_SNDMORE : 0);
+        }
+
+        if (rc >= 0)
+        {
+            ++ stats.forwarded;
+            cache.store(cached);
+        }
+        for (size_t i = 0; i < frames.size(); ++ i)
+        {
+            zmq_msg_close(frames[i]);
+            delete frames[i];
+        }
+        for (size_t i = 0; i < cached.size(); ++ i)
+        {
+            zmq_msg_close(cached[i]);
+            delete cached[i];
+        }
+        return rc < 0 ? -1 : 0;
+    }
+
+    /** Pass a (un)subscription upstream, and replay the matching topics if it
+    is a subscription. XPUB has no way to address a single subscriber, so the
+    other subscribers of these topics see the latest values again too. */
+    int forward_subscription()
+    {
+        zmq_msg_t msg;
+        zmq_msg_init(&msg);
+        if (zmq_msg_recv(&msg, backend->handle, 0) < 0)
+        {
+            zmq_msg_close(&msg);
+            return -1;
+        }
+
+        std::vector<const std::vector<zmq_msg_t*>*> matches;
+        size_t size = zmq_msg_size(&msg);
+        const unsigned char* data = static_cast<const unsigned char*>(zmq_msg_data(&msg));
+        if (size > 0 && data[0] == 1)
+        {
+            ++ stats.subscriptions;
+            cache.collect(data + 1, size - 1, matches);
+        }
+
+        int rc = zmq_msg_send(&msg, frontend->handle, 0);
+        zmq_msg_close(&msg);
+        if (rc < 0)
+            return -1;
+
+        if (!matches.empty())
+            ++ stats.hits;
+        for (size_t i = 0; i < matches.size(); ++ i)
+        {
+            if (send_copies(backend->handle, *matches[i]) < 0)
+                return -1;
+            ++ stats.replayed;
+        }
+        return 0;
+    }
+
+    /** Answer a command: 'S' for the statistics, 'T' to stop. Returns whether
+    the proxy should keep running. */
+    bool serve_control(void* control)
+    {
+        char command = 0;
+        if (zmq_recv(control, &command, 1, 0) < 0)
+            return errno != ETERM;
+
+        stats.topics = cache.topics();
+        stats.bytes = cache.bytes();
+        stats.evictions = cache.evictions;
+        if (command == 'S')
+            zmq_send(control, &stats, sizeof(stats), 0);
+        else
+            zmq_send(control, &command, 1, 0);
+        return command != 'T';
+    }
+
+    void run()
+    {
+        // Signals, like the SIGALRM of the emulator, are for the Oz thread.
+        sigset_t signals;
+        sigfillset(&signals);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+        void* control = zmq_socket(context, ZMQ_REP);
+        int linger = 0;
+        zmq_setsockopt(control, ZMQ_LINGER, &linger, sizeof(linger));
+        bool keep_running = control != NULL
+                && zmq_bind(control, control_endpoint.c_str()) == 0;
+
+        zmq_pollitem_t items[3];
+        memset(items, 0, sizeof(items));
+        items[0].socket = frontend->handle;
+        items[1].socket = backend->handle;
+        items[2].socket = control;
+        for (int i = 0; i < 3; ++ i)
+            items[i].events = ZMQ_POLLIN;
+
+        while (keep_running)
+        {
+            if (zmq_poll(items, 3, -1) < 0)
+            {
+                keep_running = errno == EINTR;
+                continue;
+            }
+            if ((items[0].revents & ZMQ_POLLIN) && forward_publication() < 0)
+                keep_running = errno != ETERM;
+            if ((items[1].revents & ZMQ_POLLIN) && forward_subscription() < 0)
+                keep_running = keep_running && errno != ETERM;
+            if (items[2].revents & ZMQ_POLLIN)
+                keep_running = keep_running && serve_control(control);
+        }
+
+        // Closing here lets a concurrent zmq_ctx_destroy finish.
+        if (control != NULL)
+            zmq_close(control);
+        zmq_close(frontend->handle);
+        zmq_close(backend->handle);
+        __sync_synchronize();
+        running = 0;
+    }
+
+    static void* thread_main(void* self)
+    {
+        static_cast<LvcProxyState*>(self)->run();
+        return NULL;
+    }
+
+    int start()
+    {
+    #ifdef ZMQ_XPUB_VERBOSE
+        // Pass on every subscription, not just the first of each topic, so that
+        // late subscribers get the cached values too.
+        int verbose = 1;
+        zmq_setsockopt(backend->handle, ZMQ_XPUB_VERBOSE, &verbose, sizeof(verbose));
+    #endif
+        running = 1;
+        int rc = pthread_create(&thread, NULL, thread_main, this);
+        if (rc != 0)
+        {
+            running = 0;
+            errno = rc;
+            return -1;
+        }
+        return 0;
+    }
+
+    /** Send a command to the proxy thread and wait for the reply. Each command
+    uses a fresh REQ socket, so nothing is left open in the context when the
+    proxy exits on its own. */
+    int command(char request, void* reply, size_t reply_size)
+    {
+        void* socket = zmq_socket(context, ZMQ_REQ);
+        if (socket == NULL)
+            return -1;
+        int linger = 0;
+        zmq_setsockopt(socket, ZMQ_LINGER, &linger, sizeof(linger));
+
+        int rc = zmq_connect(socket, control_endpoint.c_str());
+        if (rc == 0)
+            rc = zmq_send(socket, &request, 1, 0);
+        while (rc >= 0)
+        {
+            zmq_pollitem_t item = {socket, 0, ZMQ_POLLIN, 0};
+            rc = zmq_poll(&item, 1, 100 * OZZERO_POLL_MSEC);
+            if (rc > 0)
+            {
+                rc = zmq_recv(socket, reply, reply_size, 0);
+                break;
+            }
+            if (rc < 0 && errno == EINTR)
+                rc = 0;
+            else if (rc == 0 && !running)
+            {
+                errno = ETERM;
+                rc = -1;
+            }
+        }
 
-/** {ZN.msgCopy +DestMessage +SrcMessage} */
-OZ_BI_define(ozzero_msg_copy, 2, 0)
-{
-    OZ_declare(Message, 0, dest);
-    ENSURE_VALID(Message, dest);
-    OZ_declare(Message, 1, src);
-    ENSURE_VALID(Message, src);
-    return checked(dest->copy(*src));
-}
-OZ_BI_end
+        int error_number = errno;
+        zmq_close(socket);
+        errno = error_number;
+        return rc < 0 ? -1 : 0;
+    }
 
-/** {ZN.msgSetData +Message +ByteString} */
-OZ_BI_define(ozzero_msg_set_data, 2, 0)
+    /** Stop the proxy thread if it is still running, and wait for it. */
+    void stop()
+    {
+        char reply;
+        if (running)
+            command('T', &reply, 1);
+        pthread_join(thread, NULL);
+    }
+};
+
+int g_id_LvcProxy;
+class LvcProxy : public Extension<LvcProxy, LvcProxyState*, g_id_LvcProxy>
 {
-    OZ_declare(Message, 0, msg);
-    OZ_declareByteString(1, data);
-    ENSURE_VALID(Message, msg);
-    size_t size = data->getSize();
-    size_t required_size = msg->size();
-    if (size == required_size)
+public:
+    explicit LvcProxy(LvcProxyState* obj) : Extension(obj) {}
+
+    bool is_valid() const { return _obj != NULL; }
+
+    virtual OZ_Term printV(int depth)
     {
-        msg->set_data(data->getData(), size);
-        return OZ_ENTAILED;
+        return OZ_mkTupleC("#", 3,
+                           OZ_atom("<Z14.LvcProxy "),
+                           OZ_unsignedLong(reinterpret_cast<uintptr_t>(_obj)),
+                           OZ_atom(">"));
     }
+};
 
-    char buffer[100];
-    snprintf(buffer, sizeof(buffer),
-             "Invalid data size: requiring %zu, but %zu is provided",
-             required_size, size);
-    return OZ_raiseErrorC("zmqError", 2, OZ_atom("invalidDataSize"), OZ_string(buffer));
-}
-OZ_BI_end
+#endif
 
-/** {ZN.msgGet +Message +OptA ?RetI} */
-OZ_BI_define(ozzero_msg_get, 2, 1)
+/** {ZN.lvcStart +FrontendSocket +BackendSocket +MaxTopicsI +MaxBytesI ?LvcProxy}
+
+Start a last value cache proxy from an XSUB socket to an XPUB socket. Both
+sockets are handed over to the proxy: they are invalid in Oz from now on, and
+are closed when the proxy is. A limit of 0 means no limit.
+*/
+OZ_BI_define(ozzero_lvc_start, 4, 1)
 {
-    OZ_declare(Message, 0, msg);
-    ENSURE_VALID(Message, msg);
-    OZ_declareAndDecode(g_atom_decoder.msg_getset_map, "message option", 1, option);
+#if ZMQ_VERSION < 30101
+    OZ_error("To use the last value cache proxy, please recompile with ZeroMQ v3.1.1 or above.");
+    return OZ_FAILED;
+#else
+    OZ_declare(Socket, 0, frontend);
+    ENSURE_VALID(Socket, frontend);
+    OZ_declare(Socket, 1, backend);
+    ENSURE_VALID(Socket, backend);
+    OZ_declareLong(2, max_topics);
+    OZ_declareLong(3, max_bytes);
 
-    int res = msg->get(option);
-    if (res < 0)
+    if (frontend->_obj == backend->_obj
+            || frontend->state().context != backend->state().context)
+        return OZ_typeError(1, "socket of the same context as the frontend");
+
+    LvcProxyState* state = new LvcProxyState(frontend->_obj, backend->_obj,
+                                             std::max(max_topics, 0L),
+                                             std::max(max_bytes, 0L));
+    if (state->start() != 0)
+    {
+        int error_number = errno;
+        delete state;
+        errno = error_number;
         return raise_error();
-    else
-        return res;
+    }
+    frontend->state().proxied = true;
+    backend->state().proxied = true;
+    frontend->_obj = NULL;
+    backend->_obj = NULL;
+    OZ_RETURN(OZ_extension(new LvcProxy(state)));
+#endif
 }
 OZ_BI_end
 
-/** {ZN.msgSet +Message +OptA +ValueI} */
-OZ_BI_define(ozzero_msg_set, 3, 0)
+/** {ZN.lvcStats +LvcProxy ?StatsR} */
+OZ_BI_define(ozzero_lvc_stats, 1, 1)
 {
-    OZ_declare(Message, 0, msg);
-    ENSURE_VALID(Message, msg);
-    OZ_declareAndDecode(g_atom_decoder.msg_getset_map, "message option", 1, option);
-    OZ_declareInt(2, value);
+#if ZMQ_VERSION < 30101
+    OZ_error("To use the last value cache proxy, please recompile with ZeroMQ v3.1.1 or above.");
+    return OZ_FAILED;
+#else
+    OZ_declare(LvcProxy, 0, proxy);
+    ENSURE_VALID(LvcProxy, proxy);
 
-    return checked(msg->set(option, value));
+    LvcStats stats;
+    if (proxy->_obj->command('S', &stats, sizeof(stats)) != 0)
+        return raise_error();
+
+    double hit_rate = stats.subscriptions == 0 ? 0.0
+                    : static_cast<double>(stats.hits) / stats.subscriptions;
+    OZ_Term props[] = {
+        OZ_pairA("topics", OZ_uint64(stats.topics)),
+        OZ_pairA("bytes", OZ_uint64(stats.bytes)),
+        OZ_pairA("forwarded", OZ_uint64(stats.forwarded)),
+        OZ_pairA("subscriptions", OZ_uint64(stats.subscriptions)),
+        OZ_pairA("hits", OZ_uint64(stats.hits)),
+        OZ_pairA("hitRate", OZ_float(hit_rate)),
+        OZ_pairA("replayed", OZ_uint64(stats.replayed)),
+        OZ_pairA("evictions", OZ_uint64(stats.evictions)),
+    };
+    OZ_Term prop_list = OZ_toList(sizeof(props)/sizeof(*props), props);
+    OZ_RETURN(OZ_recordInitC("lvc", prop_list));
+#endif
 }
 OZ_BI_end
 
+/** {ZN.lvcClose +LvcProxy}
 
-/** {ZN.msgCreateWithData +ByteString ?Message} */
-OZ_BI_define(ozzero_msg_create_with_data, 1, 1)
+Stop the proxy and close its sockets. This also frees the cache.
+*/
+OZ_BI_define(ozzero_lvc_close, 1, 0)
 {
-    OZ_declareByteString(0, data);
-    Message* msg = new Message();
-    size_t size = data->getSize();
-    msg->init_size(size);
-    msg->set_data(data->getData(), size);
-    OZ_RETURN(OZ_extension(msg));
-}
-OZ_BI_end
+#if ZMQ_VERSION < 30101
+    OZ_error("To use the last value cache proxy, please recompile with ZeroMQ v3.1.1 or above.");
+    return OZ_FAILED;
+#else
+    OZ_declare(LvcProxy, 0, proxy);
+    LvcProxyState* state = proxy->_obj;
+    if (state == NULL)
+        return OZ_ENTAILED;
+    proxy->_obj = NULL;
 
-/** {ZN.msgSend +Message +Socket +FlagsL ?Completed ?Interrupted} */
-OZ_BI_define(ozzero_msg_send, 3, 2)
-{
-    OZ_declare(Message, 0, msg);
-    OZ_declare(Socket, 1, socket);
-    OZ_declareDetTerm(2, flags_term);
-    return send_or_recv(socket, msg, flags_term, &Message::send,
-                        OZ_out(0), OZ_out(1));
+    state->stop();
+    delete state->frontend;
+    delete state->backend;
+    delete state;
+    return OZ_ENTAILED;
+#endif
 }
 OZ_BI_end
 
-/** {ZN.msgRecv +Message +Socket +FlagsL ?Completed ?Interrupted} */
-OZ_BI_define(ozzero_msg_recv, 3, 2)
-{
-    OZ_declare(Message, 0, msg);
-    OZ_declare(Socket, 1, socket);
-    OZ_declareDetTerm(2, flags_term);
-    return send_or_recv(socket, msg, flags_term, &Message::recv,
-                        OZ_out(0), OZ_out(1));
-}
-OZ_BI_end
+//}}}
+//------------------------------------------------------------------------------
+//{{{ Context shutdown
 
-static OZ_Return send_or_recv(Socket* socket, Message* msg, OZ_Term flags_term,
-                              int (Message::*method)(Socket&, int),
-                              OZ_Term& retval, OZ_Term& interrupted)
+/** A context being terminated on a native thread. zmq_ctx_destroy blocks until
+every socket is closed and has flushed its linger, so it must not run on the
+emulator thread. The thread writes a byte to 'pipe_fds[1]' when it is done,
+which the Oz side waits for with OS.readSelect. */
+struct ShutdownState
 {
-    ENSURE_VALID(Socket, socket);
-    ENSURE_VALID(Message, msg);
+    void* context;
+    pthread_t thread;
+    int pipe_fds[2];
+    int rc;
+    int error_number;
 
-    int flags;
-    PARSE_FLAGS(g_atom_decoder.send_recv_flags_map, "send/recv options",
-                2, flags_term, flags);
+    explicit ShutdownState(void* context_) : context(context_), rc(0), error_number(0)
+    {
+        pipe_fds[0] = pipe_fds[1] = -1;
+    }
 
-    interrupted = OZ_false();
-    if ((msg->*method)(*socket, flags) >= 0)
+    ~ShutdownState()
     {
-        retval = OZ_true();
-        return OZ_ENTAILED;
+        if (pipe_fds[0] >= 0)
+            close(pipe_fds[0]);
+        if (pipe_fds[1] >= 0)
+            close(pipe_fds[1]);
     }
-    else {
-        int error_number = errno;
-        switch (error_number)
+
+    void run()
+    {
+        sigset_t signals;
+        sigfillset(&signals);
+        pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+        do
         {
-            case EAGAIN:
-                retval = OZ_false();
-                return OZ_ENTAILED;
-            case EINTR:
-                if (!am.isSetSFlag(SigPending))
-                {
-                    interrupted = OZ_true();
-                    return OZ_ENTAILED;
-                }
-                // else fallthrough
-            default:
-                return raise_error();
+        #if ZMQ_VERSION >= 30101
+            rc = zmq_ctx_destroy(context);
+        #else
+            rc = zmq_term(context);
+        #endif
         }
+        while (rc != 0 && errno == EINTR);
+        error_number = rc == 0 ? 0 : errno;
+
+        char done = 1;
+        while (write(pipe_fds[1], &done, 1) < 0 && errno == EINTR)
+            ;
     }
-}
 
-//}}}
-//------------------------------------------------------------------------------
-//{{{ Poll
+    static void* thread_main(void* self)
+    {
+        static_cast<ShutdownState*>(self)->run();
+        return NULL;
+    }
+};
 
-/** {ZN.poll
-        ['#'(+Socket +EventsL Action) ...]
-        +Timeout
-        ?Completed
-        ['#'(?Socket ?EventsL Action) ...]
-        ?InterruptedNewTimeout} */
-OZ_BI_define(ozzero_poll, 2, 3)
+int g_id_Shutdown;
+class Shutdown : public Extension<Shutdown, ShutdownState*, g_id_Shutdown>
 {
-    OZ_declareDetTerm(0, poll_items_term);
-    OZ_declareLong(1, timeout);
-
-    OZ_Term socket_atom = OZ_atom("socket");
-    OZ_Term events_atom = OZ_atom("events");
-    OZ_Term action_atom = OZ_atom("action");
+public:
+    explicit Shutdown(ShutdownState* obj) : Extension(obj) {}
 
-    std::vector<zmq_pollitem_t> poll_items;
-    std::vector<OZ_Term> actions;
+    bool is_valid() const { return _obj != NULL; }
 
-    while (OZ_isCons(poll_items_term))
+    virtual OZ_Term printV(int depth)
     {
-        OZ_Term poll_item_term = OZ_head(poll_items_term);
-        if (!OZ_isTuple(poll_item_term) || OZ_width(poll_item_term) != 3)
-            return OZ_typeError(0, "list of 3-tuples");
-
-        OZ_Term socket_term = OZ_getArg(poll_item_term, 0);
-        OZ_Term events_term = OZ_getArg(poll_item_term, 1);
-        OZ_Term action_term = OZ_getArg(poll_item_term, 2);
-
-        Socket* socket = Socket::coerce(socket_term);
-        ENSURE_VALID(Socket, socket);
-        short events;
-        PARSE_FLAGS(g_atom_decoder.poll_events_map, "'pollin' or 'pollout'",
-                    0, events_term, events);
-
-        zmq_pollitem_t poll_item;
-        poll_item.socket = socket->_obj;
-        poll_item.fd = 0;
-        poll_item.events = events;
-        poll_items.push_back(poll_item);
-
-        actions.push_back(action_term);
-
-        poll_items_term = OZ_tail(poll_items_term);
+        return OZ_mkTupleC("#", 3,
+                           OZ_atom("<Z14.Shutdown "),
+                           OZ_unsignedLong(reinterpret_cast<uintptr_t>(_obj ? _obj->context : NULL)),
+                           OZ_atom(">"));
     }
+};
 
-    int result_count;
+/** {ZN.ctxShutdown +Context +LingerI ?Shutdown ?FdI}
 
-    size_t poll_items_count = poll_items.size();
+Close every socket still open in the context, found through its registry
+rather than the Oz finalizers, after setting their linger to 'LingerI'
+milliseconds if that is not negative. Then terminate the context on a new
+thread. The context and its sockets are invalid from now on. 'FdI' becomes
+readable when the termination is over; call ctxShutdownFinish then.
 
-    bool is_eintr = false;
-    timespec start_time;
-    clock_gettime(CLOCK_MONOTONIC, &start_time);
-    TRAPPING_SIGALRM(is_eintr,
-        result_count = zmq_poll(poll_items.data(), poll_items_count, timeout)
-    );
-    if (!is_eintr)
+Sockets owned by a last value cache proxy are left to it. Termination makes
+the proxy stop and close them.
+*/
+OZ_BI_define(ozzero_ctx_shutdown, 2, 2)
+{
+    OZ_declare(Context, 0, context);
+    ENSURE_VALID(Context, context);
+    OZ_declareInt(1, linger);
+
+    ContextState* state = context->_obj;
+    ShutdownState* shutdown = new ShutdownState(state->handle);
+    if (pipe(shutdown->pipe_fds) != 0)
     {
-        OZ_out(2) = OZ_unit();
+        int error_number = errno;
+        delete shutdown;
+        errno = error_number;
+        return raise_error();
     }
-    else
+    fcntl(shutdown->pipe_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(shutdown->pipe_fds[1], F_SETFD, FD_CLOEXEC);
+
+    for (std::set<SocketState*>::iterator it = state->sockets.begin(); it != state->sockets.end(); ++ it)
     {
-        if (timeout > 0)
-        {
-            timespec end_time;
-            clock_gettime(CLOCK_MONOTONIC, &end_time);
-            long time_elapsed = (end_time.tv_sec - start_time.tv_sec) * 1000;
-            time_elapsed += (end_time.tv_nsec - start_time.tv_nsec) / 1000000;
-            OZ_out(2) = OZ_long(timeout - time_elapsed);
-        }
-        else
-        {
-            OZ_out(2) = OZ_long(timeout);
-        }
+        SocketState* socket = *it;
+        if (socket->handle != NULL && !socket->proxied)
+            socket->shut_down(linger);
     }
-    OZ_out(0) = (result_count == 0) ? OZ_false() : OZ_true();
 
-    if (result_count <= 0)
+    int rc = pthread_create(&shutdown->thread, NULL, ShutdownState::thread_main, shutdown);
+    if (rc != 0)
     {
-        OZ_out(1) = OZ_nil();
+        // The sockets are closed already; ctxDestroy can still terminate the
+        // context, only on this thread.
+        delete shutdown;
+        errno = rc;
+        return raise_error();
     }
-    else
-    {
-        std::vector<OZ_Term> result_terms;
-        result_terms.reserve(result_count);
-        OZ_Term pollin_atom = OZ_atom("pollin");
-        OZ_Term pollout_atom = OZ_atom("pollout");
-        OZ_Term pollerr_atom = OZ_atom("pollerr");
-        for (size_t i = 0; i < poll_items_count; ++ i)
-        {
-            short revents = poll_items[i].revents;
-            if (revents == 0)
-                continue;
 
-            size_t revents_count = 0;
-            OZ_Term revents_terms[3];
-            if (revents & ZMQ_POLLIN)
-                revents_terms[revents_count++] = pollin_atom;
-            if (revents & ZMQ_POLLOUT)
-                revents_terms[revents_count++] = pollout_atom;
-            if (revents & ZMQ_POLLERR)
-                revents_terms[revents_count++] = pollerr_atom;
+    context->_obj = NULL;
+    state->handle = NULL;
+    state->release();
 
-            OZ_Term revents_term = OZ_toList(revents_count, revents_terms);
-            result_terms.push_back(OZ_pair2(revents_term, actions[i]));
-        }
-        OZ_out(1) = OZ_toList(result_terms.size(), result_terms.data());
+    OZ_out(0) = OZ_extension(new Shutdown(shutdown));
+    OZ_out(1) = OZ_int(shutdown->pipe_fds[0]);
+    return OZ_ENTAILED;
+}
+OZ_BI_end
+
+/** {ZN.ctxShutdownFinish +Shutdown}
+
+Wait for the termination thread, which is over once the descriptor returned
+by ctxShutdown is readable, and raise if terminating failed.
+*/
+OZ_BI_define(ozzero_ctx_shutdown_finish, 1, 0)
+{
+    OZ_declare(Shutdown, 0, shutdown);
+    ENSURE_VALID(Shutdown, shutdown);
+
+    ShutdownState* state = shutdown->_obj;
+    shutdown->_obj = NULL;
+    pthread_join(state->thread, NULL);
+    int error_number = state->error_number;
+    delete state;
+    if (error_number != 0)
+    {
+        errno = error_number;
+        return raise_error();
     }
     return OZ_ENTAILED;
 }
@@ -1028,7 +6703,9 @@ OZ_BI_define(ozzero_device, 3, 1)
 
     int rc;
     bool is_eintr = false;
-    TRAPPING_SIGALRM(is_eintr, rc = zmq_device(device, frontend->_obj, backend->_obj));
+    TRACED(TRACE_DEVICE, frontend->handle(), rc,
+           zmq_device(device, frontend->handle(), backend->handle()));
+    TRAPPING_SIGALRM(is_eintr, rc);
     if (!is_eintr && rc)
         return raise_error();
     else
@@ -1053,9 +6730,10 @@ extern "C"
             {"ctxDestroy", 1, 1, ozzero_ctx_destroy},
             {"ctxGet", 2, 1, ozzero_ctx_get},
             {"ctxSet", 3, 0, ozzero_ctx_set},
+            {"ctxThreadLoad", 1, 1, ozzero_ctx_thread_load},
 
             // Socket
-            {"socket", 2, 1, ozzero_socket},
+            {"socket", 3, 1, ozzero_socket},
             {"close", 1, 0, ozzero_close},
             {"setsockopt", 4, 1, ozzero_setsockopt},
             {"getsockopt", 3, 1, ozzero_getsockopt},
@@ -1063,6 +6741,9 @@ extern "C"
             {"connect", 2, 0, ozzero_connect},
             {"unbind", 2, 0, ozzero_unbind},
             {"disconnect", 2, 0, ozzero_disconnect},
+            {"socketStats", 1, 1, ozzero_socket_stats},
+            {"spoolDrain", 1, 1, ozzero_spool_drain},
+            {"busyPoll", 2, 1, ozzero_busy_poll},
 
             // Message
             {"msgCreate", 0, 1, ozzero_msg_create},
@@ -1076,12 +6757,75 @@ extern "C"
             {"msgGet", 2, 1, ozzero_msg_get},
             {"msgSet", 3, 0, ozzero_msg_set},
             {"msgCreateWithData", 1, 1, ozzero_msg_create_with_data},
+            {"msgCreateWithVS", 1, 1, ozzero_msg_create_with_vs},
             {"msgSend", 3, 2, ozzero_msg_send},
             {"msgRecv", 3, 2, ozzero_msg_recv},
+            {"recvAll", 2, 3, ozzero_recv_all},
+            {"recvConflated", 4, 2, ozzero_recv_conflated},
+            {"sendToAll", 3, 1, ozzero_send_to_all},
+            {"offHeapStats", 0, 1, ozzero_off_heap_stats},
+            {"offHeapBudget", 1, 0, ozzero_off_heap_budget},
+            {"recvEnvelope", 1, 3, ozzero_recv_envelope},
+            {"reply", 3, 2, ozzero_reply},
+            {"envelopeFrames", 1, 1, ozzero_envelope_frames},
+            {"envelopeClose", 1, 0, ozzero_envelope_close},
+            {"captureStart", 2, 0, ozzero_capture_start},
+            {"captureStop", 1, 1, ozzero_capture_stop},
+            {"replayOpen", 2, 1, ozzero_replay_open},
+            {"replayStep", 4, 1, ozzero_replay_step},
+            {"replayClose", 1, 1, ozzero_replay_close},
+            {"termSend", 3, 2, ozzero_term_send},
+            {"termRecv", 2, 3, ozzero_term_recv},
+
+            // Scanning
+            {"bytesSplit", 2, 1, ozzero_bytes_split},
+            {"bytesFind", 3, 1, ozzero_bytes_find},
+            {"bytesSlice", 3, 1, ozzero_bytes_slice},
+            {"bytesParseInt", 2, 2, ozzero_bytes_parse_int},
+            {"bytesParseFloat", 2, 2, ozzero_bytes_parse_float},
+            {"bytesHasPrefix", 2, 1, ozzero_bytes_has_prefix},
+            {"msgsFromFile", 4, 1, ozzero_msgs_from_file},
+            {"sinkOpen", 2, 1, ozzero_sink_open},
+            {"sinkRecv", 2, 2, ozzero_sink_recv},
+            {"sinkClose", 1, 2, ozzero_sink_close},
+
+            // RPC client
+            {"rpcNew", 0, 1, ozzero_rpc_new},
+            {"rpcCall", 6, 2, ozzero_rpc_call},
+            {"rpcPump", 2, 3, ozzero_rpc_pump},
+            {"rpcPending", 1, 1, ozzero_rpc_pending},
+            {"rpcClose", 1, 1, ozzero_rpc_close},
 
             {"poll", 2, 3, ozzero_poll},
+
+            // Reactor
+            {"pollerNew", 0, 1, ozzero_poller_new},
+            {"pollerClose", 1, 0, ozzero_poller_close},
+            {"pollerAdd", 3, 1, ozzero_poller_add},
+            {"pollerRemove", 2, 1, ozzero_poller_remove},
+            {"pollerWait", 2, 2, ozzero_poller_wait},
+
+            {"reactorNew", 0, 1, ozzero_reactor_new},
+            {"reactorClose", 1, 0, ozzero_reactor_close},
+            {"reactorAddSocket", 3, 1, ozzero_reactor_add_socket},
+            {"reactorAddTimer", 3, 1, ozzero_reactor_add_timer},
+            {"reactorRemove", 2, 1, ozzero_reactor_remove},
+            {"reactorWait", 2, 2, ozzero_reactor_wait},
+
+            // Last value cache proxy
+            {"lvcStart", 4, 1, ozzero_lvc_start},
+            {"lvcStats", 1, 1, ozzero_lvc_stats},
+            {"lvcClose", 1, 0, ozzero_lvc_close},
+            {"ctxShutdown", 2, 2, ozzero_ctx_shutdown},
+            {"ctxShutdownFinish", 1, 0, ozzero_ctx_shutdown_finish},
+
             {"device", 3, 1, ozzero_device},
 
+            // Tracing
+            {"traceStart", 1, 0, ozzero_trace_start},
+            {"traceStop", 0, 0, ozzero_trace_stop},
+            {"traceDump", 1, 1, ozzero_trace_dump},
+
             {NULL}
         };
 
@@ -1089,6 +6833,16 @@ extern "C"
         INIT(Context);
         INIT(Message);
         INIT(Socket);
+        INIT(FileSink);
+        INIT(RpcClient);
+        INIT(Poller);
+        INIT(Reactor);
+        INIT(Envelope);
+        INIT(Replay);
+        INIT(Shutdown);
+    #if ZMQ_VERSION >= 30101
+        INIT(LvcProxy);
+    #endif
         #undef INIT
 
         return interfaces;